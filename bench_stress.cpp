@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/**
+ * Multi-process stress and scaling benchmark of `/dev/dmabuf0`.
+ *
+ * Usage: bench_stress [processes] [threads] [seconds]
+ *
+ * For each core count (1, 2, 4, ... up to processes * threads)
+ * fork N processes with M threads each (filling processes first),
+ * each thread mixes mmap scans, pread/pwrite at random offsets
+ * and repeated mmap/munmap.
+ * Reports aggregate throughput, latency percentiles
+ * and scaling efficiency relative to one thread.
+ * Failed operations are counted separately (not as throughput)
+ * and make the benchmark exit with failure.
+ */
+
+#include "test.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+
+using clock_type = std::chrono::steady_clock;
+
+// per operation statistics (shared with parent through anonymous shared mapping)
+struct stats_t {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t failures; // failed operations (not in `ops` and latency)
+    // latency histogram (log2 of ns)
+    uint64_t latency[64];
+
+    void add(uint64_t n, uint64_t ns) {
+        ops += 1;
+        bytes += n;
+        int k = 0;
+        while(k < 63 && (uint64_t(1) << (k + 1)) <= ns) k++;
+        latency[k] += 1;
+    }
+    void fail() {
+        failures += 1;
+    }
+    void merge(const stats_t& other) {
+        ops += other.ops;
+        bytes += other.bytes;
+        failures += other.failures;
+        for(int k = 0; k < 64; k++) latency[k] += other.latency[k];
+    }
+    // upper bound of percentile (ns)
+    uint64_t percentile(double p) const {
+        uint64_t n = 0;
+        for(int k = 0; k < 64; k++) {
+            n += latency[k];
+            if(n >= p * ops) return uint64_t(1) << (k + 1);
+        }
+        return 0;
+    }
+};
+
+enum { OP_SCAN, OP_PREAD, OP_PWRITE, OP_MMAP, OP_N };
+static const char* op_names[OP_N] = { "scan", "pread", "pwrite", "mmap" };
+
+static
+void worker(int fd, size_t size, uint64_t seed, double seconds, stats_t* stats) {
+    std::mt19937_64 rng(seed);
+    // not larger than the buffer (`rng() % (size / scan_size)`)
+    const size_t io_size = std::min<size_t>(64 * 1024, size), scan_size = std::min<size_t>(1024 * 1024, size);
+    std::vector<char> buffer(io_size);
+
+    // long lived mapping for scans
+    auto addr = (volatile uint64_t*)::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(addr == MAP_FAILED) {
+        FATAL("mmap: errno = %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    auto end = clock_type::now() + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(seconds));
+    while(clock_type::now() < end) {
+        int op = rng() % OP_N;
+        size_t offset = (rng() % (size / io_size)) * io_size;
+        auto t0 = clock_type::now();
+        ssize_t n = -1;
+        switch(op) {
+        case OP_SCAN: {
+            offset = (rng() % (size / scan_size)) * scan_size;
+            uint64_t sum = 0;
+            for(size_t i = 0; i < scan_size / 8; i++) sum += addr[offset / 8 + i];
+            (void)sum;
+            n = scan_size;
+            break;
+        }
+        case OP_PREAD:
+            n = pread(fd, buffer.data(), io_size, offset);
+            break;
+        case OP_PWRITE:
+            n = pwrite(fd, buffer.data(), io_size, offset);
+            break;
+        case OP_MMAP: {
+            void* p = ::mmap(nullptr, io_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+            if(p != MAP_FAILED) {
+                // fault (maps the whole entry)
+                volatile uint64_t x = *(volatile uint64_t*)p;
+                (void)x;
+                n = io_size;
+                munmap(p, io_size);
+            }
+            break;
+        }
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - t0).count();
+        if(n < 0) stats[op].fail();
+        else stats[op].add(n, ns);
+    }
+
+    munmap((void*)addr, size);
+}
+
+// run `processes * threads` workers, return merged statistics per operation
+static
+std::vector<stats_t> run(int processes, int threads, size_t size, double seconds) {
+    size_t stats_size = sizeof(stats_t) * OP_N * processes * threads;
+    auto shared = (stats_t*)::mmap(nullptr, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED) {
+        FATAL("mmap(MAP_ANONYMOUS): errno = %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    memset(shared, 0, stats_size);
+
+    fflush(stdout);
+    std::vector<pid_t> pids;
+    for(int p = 0; p < processes; p++) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            FATAL("fork: errno = %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if(pid == 0) {
+            // own file descriptor per process
+            test_t test;
+            std::vector<std::thread> workers;
+            for(int t = 0; t < threads; t++) {
+                stats_t* stats = shared + (p * threads + t) * OP_N;
+                workers.emplace_back(worker, test.fd, size, uint64_t(p * threads + t), seconds, stats);
+            }
+            for(auto& w : workers) w.join();
+            _exit(EXIT_SUCCESS);
+        }
+        pids.push_back(pid);
+    }
+    for(pid_t pid : pids) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            FATAL("worker process failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    std::vector<stats_t> total(OP_N);
+    memset(total.data(), 0, sizeof(stats_t) * OP_N);
+    for(int w = 0; w < processes * threads; w++) {
+        for(int op = 0; op < OP_N; op++) total[op].merge(shared[w * OP_N + op]);
+    }
+    munmap(shared, stats_size);
+
+    return total;
+}
+
+int main(int argc, char* argv[]) {
+    int processes = argc > 1 ? atoi(argv[1]) : 4;
+    int threads = argc > 2 ? atoi(argv[2]) : 2;
+    double seconds = argc > 3 ? atof(argv[3]) : 2;
+    // non-numeric arguments are parsed as 0
+    if(processes < 1 || threads < 1 || !(seconds > 0)) {
+        fprintf(stderr, "Usage: %s [processes >= 1] [threads >= 1] [seconds > 0]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size;
+    {
+        test_t test;
+        size = test.seek_end();
+    }
+    if(size == 0) {
+        FATAL("size = 0\n");
+        exit(EXIT_FAILURE);
+    }
+    INFO("size = 0x%zx, processes = %d, threads = %d, seconds = %.1f, cpus = %u\n",
+        size, processes, threads, seconds, std::thread::hardware_concurrency()
+    );
+
+    int exit_status = EXIT_SUCCESS;
+    double base = 0; // ops/s of one worker
+    for(int workers = 1; ; workers = std::min(2 * workers, processes * threads)) {
+        // fill processes first, then threads
+        int p = std::min(workers, processes);
+        int t = workers / p;
+        auto stats = run(p, t, size, seconds);
+
+        uint64_t ops = 0, bytes = 0;
+        for(auto& s : stats) ops += s.ops, bytes += s.bytes;
+        double rate = ops / seconds;
+        if(workers == 1) base = rate;
+
+        printf("workers = %3d (%d x %d): %10.0f ops/s, %8.1f MB/s, efficiency = %5.1f%%\n",
+            p * t, p, t, rate, bytes / seconds / 1e6, base > 0 ? 100 * rate / (base * p * t) : 0
+        );
+        for(int op = 0; op < OP_N; op++) {
+            printf("    %-6s: %10lu ops, p50 < %8lu ns, p99 < %8lu ns, p99.9 < %8lu ns, failures = %lu\n",
+                op_names[op], stats[op].ops, stats[op].percentile(0.5), stats[op].percentile(0.99), stats[op].percentile(0.999), stats[op].failures
+            );
+            if(stats[op].failures != 0) exit_status = EXIT_FAILURE;
+        }
+
+        if(p * t >= processes * threads) break;
+    }
+
+    if(exit_status != EXIT_SUCCESS) ERR("failed operations\n");
+    return exit_status;
+}
@@ -2,16 +2,28 @@
 #pragma once
 
 #include "module.h"
+#include "dmabuf_ioctl.h"
 
+#include <linux/bitops.h>
+#include <linux/capability.h>
 #include <linux/dma-mapping.h>
+#include <linux/iommu.h>
 #include <linux/list_sort.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
+#include <linux/scatterlist.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
 #include <linux/slab.h>
+#include <linux/srcu.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0) // `dma_to_phys`
-#include <linux/dma-direct.h>
-#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0) // `dma-map-ops.h`
 #include <linux/dma-map-ops.h>
 #endif
@@ -56,101 +68,1336 @@ int ida_alloc(struct ida* ida, gfp_t gfp) {
 }
 #endif
 
-struct dmabuf_entry {
-    size_t size;
-    void* cpu_addr;
-    dma_addr_t dma_handle;
-    struct list_head list_head;
-};
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0) // `totalram_pages()`
+#define totalram_pages() totalram_pages
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0) // `device_iommu_mapped`
+static inline
+bool device_iommu_mapped(struct device* dev) {
+    return dev->iommu_group != NULL;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0) // `dma_map_sgtable`
+static inline
+int dma_map_sgtable(struct device* dev, struct sg_table* sgt, enum dma_data_direction dir, unsigned long attrs) {
+    int nents = dma_map_sg_attrs(dev, sgt->sgl, sgt->orig_nents, dir, attrs);
+    if(nents <= 0) return -ENOMEM;
+    sgt->nents = nents;
+    return 0;
+}
+
+static inline
+void dma_unmap_sgtable(struct device* dev, struct sg_table* sgt, enum dma_data_direction dir, unsigned long attrs) {
+    dma_unmap_sg_attrs(dev, sgt->sgl, sgt->orig_nents, dir, attrs);
+}
+
+#define for_each_sgtable_dma_sg(sgt, sg, i) for_each_sg((sgt)->sgl, sg, (sgt)->nents, i)
+#define for_each_sgtable_sg(sgt, sg, i) for_each_sg((sgt)->sgl, sg, (sgt)->orig_nents, i)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0) // `vm_fault_t`
+typedef int vm_fault_t;
+
+static inline
+vm_fault_t vmf_insert_pfn(struct vm_area_struct* vma, unsigned long addr, unsigned long pfn) {
+    int error = vm_insert_pfn(vma, addr, pfn);
+    if(error == -ENOMEM) return VM_FAULT_OOM;
+    if(error < 0 && error != -EBUSY) return VM_FAULT_SIGBUS;
+    return VM_FAULT_NOPAGE;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0) // `pin_user_pages_fast`
+#ifndef FOLL_LONGTERM
+#define FOLL_LONGTERM 0
+#endif
+static inline
+int pin_user_pages_fast(unsigned long start, int nr_pages, unsigned int gup_flags, struct page** pages) {
+    return get_user_pages_fast(start, nr_pages, gup_flags & FOLL_WRITE, pages);
+}
+
+static inline
+void unpin_user_page(struct page* page) {
+    put_page(page);
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0) // `unpin_user_page_range_dirty_lock`
+static inline
+void unpin_user_page_range_dirty_lock(struct page* page, unsigned long npages, bool make_dirty) {
+    for(unsigned long i = 0; i < npages; i++) {
+        struct page* p = pfn_to_page(page_to_pfn(page) + i);
+        if(make_dirty) set_page_dirty_lock(p);
+        unpin_user_page(p);
+    }
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 3, 0) // `account_locked_vm`
+static inline
+int account_locked_vm(struct mm_struct* mm, unsigned long pages, bool inc) {
+    int error = 0;
+
+    down_write(&mm->mmap_sem);
+    if(!inc) mm->locked_vm -= min(pages, mm->locked_vm);
+    else if(mm->locked_vm + pages > (rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT) && !capable(CAP_IPC_LOCK)) error = -ENOMEM;
+    else mm->locked_vm += pages;
+    up_write(&mm->mmap_sem);
+
+    return error;
+}
+#endif
+
+struct dmabuf_entry {
+    size_t size;
+    void* cpu_addr;
+    dma_addr_t dma_handle;
+    struct page* page; // if allocated with alloc_pages (IOMMU mode) or pinned
+    bool pinned; // user pages pinned with pin_user_pages (see dmabuf_import.h)
+    struct mm_struct* mm; // pinned - `locked_vm` of this mm is charged for the pages
+    bool foreign; // memory owned by exporter of imported dma-buf, only `dma_handle` is set (see dmabuf_import.h)
+    struct list_head list_head;
+};
+
+/**
+ * Read-only snapshot of the buffer layout.
+ *
+ * The table is replaced (not modified) on layout change
+ * and accessed with srcu_dereference under dmabuf->srcu,
+ * such that read/write/fault handlers do not take any shared lock.
+ * Only slots of a sparse table are set in place (see dmabuf_sparse_commit).
+ */
+struct dmabuf_table {
+    struct dmabuf* dmabuf; // owner
+    size_t size; // buffer size
+    u64 generation; // incremented on each layout change
+    unsigned int count;
+    // sparse mode - entries are slots of fixed size,
+    // `entry` is set on first touch (see dmabuf_sparse_commit), `cpu_addr` is not used
+    bool sparse;
+    // dirty tracking - one bit per `1 << dirty_shift` bytes (NULL - disabled)
+    unsigned int dirty_shift;
+    unsigned long* dirty;
+    // linear kernel mapping of the buffer (NULL - use `cpu_addr` of entries)
+    void* vaddr;
+    // streaming mapping of the entries (IOMMU mode or imported pages, `sgl` NULL - coherent memory),
+    // copy of dmabuf->sgt that stays mapped while the table is used (see dmabuf_table_sync_for_cpu)
+    struct sg_table sgt;
+    // imported dma-buf - no CPU access (see dmabuf_import_dma_buf_entries)
+    bool foreign;
+    struct dmabuf_table_entry {
+        size_t offset; // offset of entry in buffer
+        size_t size;
+        void* cpu_addr;
+        // copy of `entry->dma_handle` (changes in place when the buffer is mapped again)
+        dma_addr_t dma_addr;
+        struct dmabuf_entry* entry;
+    } entries[];
+};
+
+struct dmabuf {
+    struct device* dev;
+    struct dmabuf_table __rcu* table;
+    struct srcu_struct srcu;
+    bool iommu;
+    unsigned int dirty_shift; // granularity of dirty tracking (0 - disabled)
+    bool sparse; // memory is allocated on first touch (see dmabuf_sparse_commit)
+    // sparse mode - shared by commits, exclusive for table replace and decommit
+    struct rw_semaphore commit_lock;
+    bool imported; // entries are not allocated by the driver
+    // release imported memory after its entries are freed (e.g. detach dma-buf)
+    void (*release)(void* data);
+    void* release_data;
+
+    // control operations (resize, etc.) - serialized by `lock`
+    struct mutex lock ____cacheline_aligned_in_smp;
+    size_t size;
+    struct list_head entries;
+    // IOMMU mode - entries are pages mapped with dma_map_sgtable
+    struct sg_table sgt;
+};
+
+static
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 70) // use const
+int dmabuf_entry_cmp(void* priv, const struct list_head* a, const struct list_head* b) {
+#else
+int dmabuf_entry_cmp(void* priv, struct list_head* a, struct list_head* b) {
+#endif
+    dma_addr_t aa = container_of(a, struct dmabuf_entry, list_head)->dma_handle;
+    dma_addr_t bb = container_of(b, struct dmabuf_entry, list_head)->dma_handle;
+    if(aa < bb) return -1;
+    if(aa > bb) return +1;
+    return 0;
+}
+
+static bool dmabuf_compact = false;
+module_param_named(compact, dmabuf_compact, bool, 0644);
+MODULE_PARM_DESC(compact, "allow reclaim and compaction for large entries in dmabuf_alloc");
+
+static bool dmabuf_iommu = true;
+module_param_named(iommu, dmabuf_iommu, bool, 0444);
+MODULE_PARM_DESC(iommu, "map buffer into one contiguous IOVA range if device is behind IOMMU");
+
+static ulong dmabuf_max_size = 0;
+module_param_named(max_size, dmabuf_max_size, ulong, 0644);
+MODULE_PARM_DESC(max_size, "max buffer size in bytes for DMABUF_IOCTL_RESIZE without CAP_SYS_ADMIN (0 - half of RAM)");
+
+static ulong dmabuf_chunk_size = 1024 * 1024;
+module_param_named(chunk, dmabuf_chunk_size, ulong, 0644);
+MODULE_PARM_DESC(chunk, "max bytes copied between reschedule points in read/write and bulk operations (0 - entry size)");
+
+static bool dmabuf_vmap = true;
+module_param_named(vmap, dmabuf_vmap, bool, 0444);
+MODULE_PARM_DESC(vmap, "map whole buffer into one linear kernel address range for in-kernel copies");
+
+static bool dmabuf_sparse = false;
+module_param_named(sparse, dmabuf_sparse, bool, 0444);
+MODULE_PARM_DESC(sparse, "allocate buffer memory on first touch (page fault, write or DMABUF_IOCTL_COMMIT)");
+
+static ulong dmabuf_dirty_granule = 0;
+module_param_named(dirty, dmabuf_dirty_granule, ulong, 0444);
+MODULE_PARM_DESC(dirty, "granularity of dirty tracking in bytes (rounded up to power of 2, at least page size, 0 - disabled)");
+
+// max size of one copy between reschedule points (at least one page)
+static
+size_t dmabuf_chunk_max(void) {
+    size_t chunk = READ_ONCE(dmabuf_chunk_size);
+    if(chunk == 0) return SIZE_MAX;
+    return max_t(size_t, chunk, PAGE_SIZE);
+}
+
+// yield CPU between chunks of long copies
+static
+int dmabuf_yield(void) {
+    if(fatal_signal_pending(current)) return -EINTR;
+    cond_resched();
+    return 0;
+}
+
+/**
+ * Check new buffer size (resize or import).
+ *
+ * The buffer must not reach into the next bank (see DMABUF_BANK_OFFSET),
+ * allocating more than `max_size` (module parameter) requires CAP_SYS_ADMIN,
+ * such that a user of the device can not exhaust system memory.
+ *
+ * @param size - new buffer size
+ * @param alloc - memory of this size is allocated (not sparse or imported)
+ *
+ * @retval -EINVAL - if size is 0, not multiple of page size or larger than DMABUF_BANK_OFFSET(1)
+ * @retval -EPERM - if size is larger than `max_size` and the caller does not have CAP_SYS_ADMIN
+ */
+static
+int dmabuf_size_check(u64 size, bool alloc) {
+    u64 max_size = READ_ONCE(dmabuf_max_size);
+
+    if(size == 0 || !IS_ALIGNED(size, PAGE_SIZE) || size > DMABUF_BANK_OFFSET(1)) return -EINVAL;
+    if(max_size == 0) max_size = ((u64)totalram_pages() << PAGE_SHIFT) / 2;
+    if(alloc && size > max_size && !capable(CAP_SYS_ADMIN)) return -EPERM;
+
+    return 0;
+}
+
+// start from min of PMD (2 MiB) and 4096 pages (16 MiB)
+static
+size_t dmabuf_entry_size_max(void) {
+    return min_t(size_t, PMD_SIZE, PAGE_SIZE << 12);
+}
+
+/**
+ * Find entry that contains offset (binary search).
+ *
+ * @param table - pointer to struct dmabuf_table
+ * @param offset - offset in buffer (less than table->size)
+ *
+ * @return - index of entry in table->entries
+ */
+static
+unsigned int dmabuf_table_find(struct dmabuf_table* table, size_t offset) {
+    unsigned int lo = 0, hi = table->count;
+
+    while(hi - lo > 1) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if(table->entries[mid].offset <= offset) lo = mid;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+// number of bits in dirty bitmap
+static
+size_t dmabuf_dirty_bits(size_t size, unsigned int shift) {
+    return shift == 0 ? 0 : DIV_ROUND_UP(size, (size_t)1 << shift);
+}
+
+/**
+ * Mark range as dirty (see DMABUF_IOCTL_DIRTY_GET).
+ *
+ * Called after the range is written,
+ * such that a concurrent DMABUF_IOCTL_DIRTY_GET
+ * does not report the range before the data is there.
+ *
+ * @param table - pointer to struct dmabuf_table (under dmabuf->srcu)
+ */
+static
+void dmabuf_dirty_set(struct dmabuf_table* table, size_t offset, size_t size) {
+    size_t first, last;
+
+    if(table->dirty == NULL || offset >= table->size || size == 0) return;
+    if(size > table->size - offset) size = table->size - offset;
+
+    first = offset >> table->dirty_shift;
+    last = (offset + size - 1) >> table->dirty_shift;
+    for(size_t i = first; i <= last; i++) {
+        // do not dirty the cache line if already set
+        if(!test_bit(i, table->dirty)) set_bit(i, table->dirty);
+    }
+}
+
+/**
+ * Merge dirty bits of old table into new table (common range).
+ *
+ * The new table is already published (bits are set concurrently).
+ */
+static
+void dmabuf_dirty_merge(struct dmabuf_table* table, struct dmabuf_table* old) {
+    size_t bits;
+
+    if(table->dirty == NULL || old->dirty == NULL) return;
+    bits = min(dmabuf_dirty_bits(table->size, table->dirty_shift), dmabuf_dirty_bits(old->size, old->dirty_shift));
+
+    for(size_t i = 0; i < BITS_TO_LONGS(bits); i++) {
+        unsigned long word = old->dirty[i];
+        if(i == BIT_WORD(bits)) word &= BITMAP_LAST_WORD_MASK(bits);
+        if(word != 0) atomic_long_or(word, (atomic_long_t*)&table->dirty[i]);
+    }
+}
+
+// DMA address of committed entry `i` (as of the table)
+static
+dma_addr_t dmabuf_table_dma_addr(struct dmabuf_table* table, unsigned int i, struct dmabuf_entry* entry) {
+    // slots are not remapped (no IOMMU in sparse mode)
+    if(table->sparse) return entry->dma_handle;
+    return table->entries[i].dma_addr;
+}
+
+/**
+ * Combine entries with consecutive DMA handles into one segment.
+ *
+ * Not committed slots (sparse mode) end the segment.
+ *
+ * @param table - pointer to struct dmabuf_table
+ * @param i - index of first entry of the segment
+ * @param segment - pointer to struct dmabuf_segment to fill
+ *
+ * @return - index of last entry of the segment (`segment->size = 0` if entry `i` is not committed)
+ */
+static
+unsigned int dmabuf_segment(struct dmabuf_table* table, unsigned int i, struct dmabuf_segment* segment) {
+    struct dmabuf_entry* entry = smp_load_acquire(&table->entries[i].entry);
+
+    segment->offset = table->entries[i].offset;
+    segment->size = 0;
+    if(entry == NULL) return i;
+    segment->dma_addr = dmabuf_table_dma_addr(table, i, entry);
+    segment->size = table->entries[i].size;
+    while(i + 1 < table->count) {
+        struct dmabuf_entry* next = smp_load_acquire(&table->entries[i + 1].entry);
+        if(next == NULL || segment->dma_addr + segment->size != dmabuf_table_dma_addr(table, i + 1, next)) break;
+        segment->size += next->size;
+        i += 1;
+    }
+    // do not expose memory above buffer size
+    if(segment->size > table->size - segment->offset) segment->size = table->size - segment->offset;
+    return i;
+}
+
+/**
+ * Count entries and contiguous DMA segments.
+ *
+ * The fragmentation score (per mille) compares number of segments
+ * with number of entries of maximal size needed for the buffer:
+ * 0 - not more segments than ideal, 1000 - every page is a separate segment.
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param table - pointer to struct dmabuf_table
+ * @param info - pointer to struct dmabuf_info to fill
+ * @param verbose - report each segment
+ */
+static
+void dmabuf_info(struct dmabuf* dmabuf, struct dmabuf_table* table, struct dmabuf_info* info, bool verbose) {
+    u64 ideal = DIV_ROUND_UP(table->size, dmabuf_entry_size_max());
+    u64 pages = table->size >> PAGE_SHIFT;
+
+    memset(info, 0, sizeof(*info));
+    info->size = table->size;
+    info->generation = table->generation;
+    if(dmabuf->iommu) info->flags |= DMABUF_INFO_IOMMU;
+    if(dmabuf->imported) info->flags |= DMABUF_INFO_IMPORTED;
+    if(dmabuf->sparse) info->flags |= DMABUF_INFO_SPARSE;
+    info->entries = table->count;
+
+    for(unsigned int i = 0; i < table->count && table->entries[i].offset < table->size; i++) {
+        struct dmabuf_segment segment;
+        // report consecutive entries as one entry
+        i = dmabuf_segment(table, i, &segment);
+        if(segment.size == 0) {
+            // not committed slot
+            info->entries -= 1;
+            continue;
+        }
+        info->segments += 1;
+        if(verbose) M_INFO("dma_handle = 0x%llx, size = 0x%llx\n", segment.dma_addr, segment.size);
+    }
+
+    if(info->segments > ideal && pages > ideal) {
+        info->fragmentation = div64_u64(1000 * (info->segments - ideal), pages - ideal);
+    }
+}
+
+/**
+ * Copy contiguous DMA segments to user space.
+ *
+ * @param table - pointer to struct dmabuf_table
+ * @param user_segments - user array of struct dmabuf_segment
+ * @param count - capacity of user array
+ *
+ * @return - total number of segments (may be larger than count)
+ */
+static
+ssize_t dmabuf_segments(struct dmabuf_table* table, struct dmabuf_segment __user* user_segments, u64 count) {
+    ssize_t n = 0;
+
+    for(unsigned int i = 0; i < table->count && table->entries[i].offset < table->size; i++) {
+        struct dmabuf_segment segment;
+        i = dmabuf_segment(table, i, &segment);
+        if(segment.size == 0) continue;
+        if(n < count && copy_to_user(&user_segments[n], &segment, sizeof(segment)) != 0) return -EFAULT;
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * Report contiguous DMA handles.
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ *
+ * @return - number of contiguous DMA handles
+ */
+static
+int dmabuf_report(struct dmabuf* dmabuf) {
+    struct dmabuf_info info;
+    int idx;
+
+    if(IS_ERR_OR_NULL(dmabuf)) return -EFAULT;
+
+    idx = srcu_read_lock(&dmabuf->srcu);
+    dmabuf_info(dmabuf, srcu_dereference(dmabuf->table, &dmabuf->srcu), &info, true);
+    srcu_read_unlock(&dmabuf->srcu, idx);
+    M_INFO("-> %llu dma_handle entries\n", info.entries);
+    M_INFO("-> %llu segments, fragmentation = %llu/1000\n", info.segments, info.fragmentation);
+
+    return info.segments;
+}
+
+/**
+ * Allocate memory for entry of size entry->size.
+ *
+ * Use alloc_pages in IOMMU mode (mapped later with dma_map_sgtable)
+ * and dma_alloc_coherent otherwise.
+ */
+static
+int dmabuf_entry_alloc(struct dmabuf* dmabuf, struct dmabuf_entry* entry, gfp_t gfp) {
+    int error;
+
+    if(dmabuf->iommu) {
+        M_DEBUG("alloc_pages(size = 0x%zx)\n", entry->size);
+        entry->page = alloc_pages(gfp | __GFP_ZERO, get_order(entry->size));
+        if(entry->page == NULL) return -ENOMEM;
+        entry->cpu_addr = page_address(entry->page);
+        return 0;
+    }
+
+    M_DEBUG("dma_alloc_coherent(size = 0x%zx)\n", entry->size);
+    entry->cpu_addr = dma_alloc_coherent(dmabuf->dev, entry->size, &entry->dma_handle, gfp); // see `pci_alloc_consistent`
+    if(IS_ERR_OR_NULL(entry->cpu_addr)) {
+        if(entry->cpu_addr == NULL) error = -ENOMEM;
+        else error = PTR_ERR(entry->cpu_addr);
+        entry->cpu_addr = NULL;
+        return error;
+    }
+
+    return 0;
+}
+
+static
+void dmabuf_entry_free(struct dmabuf* dmabuf, struct dmabuf_entry* entry) {
+    if(entry->pinned) {
+        M_DEBUG("unpin_user_pages(size = 0x%zx)\n", entry->size);
+        // the device may have written to the pages
+        unpin_user_page_range_dirty_lock(entry->page, entry->size >> PAGE_SHIFT, true);
+        if(entry->mm != NULL) {
+            account_locked_vm(entry->mm, entry->size >> PAGE_SHIFT, false);
+            mmdrop(entry->mm);
+        }
+    }
+    else if(entry->foreign) {
+        // released with dmabuf->release
+    }
+    else if(entry->page != NULL) {
+        M_DEBUG("__free_pages(size = 0x%zx)\n", entry->size);
+        __free_pages(entry->page, get_order(entry->size));
+    }
+    else if(entry->cpu_addr != NULL) {
+        M_DEBUG("dma_free_coherent(dma_handle = %pad, size = 0x%zx)\n", &entry->dma_handle, entry->size);
+        dma_free_coherent(dmabuf->dev, entry->size, entry->cpu_addr, entry->dma_handle);
+    }
+    kfree(entry);
+}
+
+/**
+ * Allocate memory of sparse slot on first touch.
+ *
+ * The slot is committed into the current table
+ * (`table` may have been replaced, the slot index is the same),
+ * a concurrent commit of the same slot wins the race and this entry is freed.
+ * The entry is published with cmpxchg (after it is initialized),
+ * such that readers under dmabuf->srcu see either NULL or a complete entry.
+ *
+ * @param table - pointer to struct dmabuf_table (under dmabuf->srcu)
+ * @param i - index of slot
+ *
+ * @return - committed entry or NULL if out of memory or the slot is above size of the current table
+ */
+static
+struct dmabuf_entry* dmabuf_sparse_commit(struct dmabuf_table* table, unsigned int i) {
+    struct dmabuf* dmabuf = table->dmabuf;
+    struct dmabuf_table* cur;
+    struct dmabuf_entry* entry, *committed = NULL;
+    int error;
+
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if(entry == NULL) return NULL;
+    entry->size = table->entries[i].size;
+    INIT_LIST_HEAD(&entry->list_head);
+    error = dmabuf_entry_alloc(dmabuf, entry, GFP_KERNEL | __GFP_NOWARN);
+    if(error) {
+        M_ERR("dmabuf_entry_alloc(size = 0x%zx): error = %d\n", entry->size, error);
+        kfree(entry);
+        return NULL;
+    }
+
+    // exclude table replace and decommit
+    down_read(&dmabuf->commit_lock);
+    cur = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+    if(i < cur->count) {
+        committed = cmpxchg(&cur->entries[i].entry, NULL, entry);
+        if(committed == NULL) swap(committed, entry);
+    }
+    up_read(&dmabuf->commit_lock);
+
+    if(entry != NULL) dmabuf_entry_free(dmabuf, entry);
+    return committed;
+}
+
+/**
+ * Get entry `i` of table.
+ *
+ * @param table - pointer to struct dmabuf_table (under dmabuf->srcu)
+ * @param commit - allocate not committed slot (sparse mode)
+ *
+ * @return - entry or NULL if not committed (or out of memory)
+ */
+static
+struct dmabuf_entry* dmabuf_table_entry(struct dmabuf_table* table, unsigned int i, bool commit) {
+    struct dmabuf_entry* entry = smp_load_acquire(&table->entries[i].entry);
+    if(entry == NULL && commit && table->sparse) entry = dmabuf_sparse_commit(table, i);
+    return entry;
+}
+
+/**
+ * Get kernel address of entry `i` of table.
+ *
+ * @return - address or NULL if not committed (memory reads as zeros)
+ */
+static
+void* dmabuf_table_cpu_addr(struct dmabuf_table* table, unsigned int i, bool commit) {
+    struct dmabuf_entry* entry;
+
+    if(!table->sparse) return table->entries[i].cpu_addr;
+    entry = dmabuf_table_entry(table, i, commit);
+    return entry == NULL ? NULL : entry->cpu_addr;
+}
+
+// synchronize range of streaming mapping (see dmabuf_table_sync_for_cpu)
+static
+void dmabuf_table_sync(struct dmabuf_table* table, size_t offset, size_t size, bool for_cpu) {
+    unsigned int i;
+
+    if(table->sgt.sgl == NULL) return;
+    // do not access memory above buffer size
+    if(offset >= table->size) return;
+    if(size > table->size - offset) size = table->size - offset;
+
+    for(i = dmabuf_table_find(table, offset); i < table->count && size > 0; i++) {
+        struct dmabuf_table_entry* table_entry = &table->entries[i];
+        size_t entry_offset = offset - table_entry->offset;
+        size_t n = min(size, table_entry->size - entry_offset);
+        if(for_cpu) dma_sync_single_range_for_cpu(table->dmabuf->dev, table_entry->dma_addr, entry_offset, n, DMA_BIDIRECTIONAL);
+        else dma_sync_single_range_for_device(table->dmabuf->dev, table_entry->dma_addr, entry_offset, n, DMA_BIDIRECTIONAL);
+        offset += n;
+        size -= n;
+    }
+}
+
+/**
+ * Synchronize range of streaming mapping for CPU access
+ * (before the CPU accesses memory that the device may have written).
+ *
+ * Entries of dma_alloc_coherent (and sparse slots) are not synchronized,
+ * entries mapped with dma_map_sgtable (IOMMU mode or imported pages)
+ * are synchronized only in `[offset, offset + size)`
+ * (dma_sync_single_range_for_cpu of each touched entry).
+ * The range is handed back to the device with dmabuf_table_sync_for_device.
+ *
+ * \code
+ * dmabuf_table_sync_for_cpu(table, offset, size)
+ * memcpy(dmabuf_table_chunk(table, offset, size, ...))
+ * dmabuf_table_sync_for_device(table, offset, size)
+ * \endcode
+ */
+static
+void dmabuf_table_sync_for_cpu(struct dmabuf_table* table, size_t offset, size_t size) {
+    dmabuf_table_sync(table, offset, size, true);
+}
+
+static
+void dmabuf_table_sync_for_device(struct dmabuf_table* table, size_t offset, size_t size) {
+    dmabuf_table_sync(table, offset, size, false);
+}
+
+struct dmabuf_chunk {
+    void* addr; // NULL - out of memory (sparse slot could not be allocated)
+    size_t size; // contiguous bytes from `addr`
+};
+
+/**
+ * Get contiguous chunk of memory that starts at offset
+ * (bounded by dmabuf_chunk_max).
+ *
+ * With linear mapping (see dmabuf_table_vmap) the chunk does not end
+ * at entry boundaries, otherwise it ends at the end of the entry.
+ * Not committed slots (sparse mode) are allocated for `write`,
+ * otherwise the chunk is (at most one page of) the zero page.
+ *
+ * @param table - pointer to struct dmabuf_table
+ * @param offset - offset in buffer (less than table->size)
+ * @param size - max size of the chunk
+ * @param write - the chunk is written
+ */
+static
+struct dmabuf_chunk dmabuf_table_chunk(struct dmabuf_table* table, size_t offset, size_t size, bool write) {
+    struct dmabuf_table_entry* table_entry;
+    struct dmabuf_chunk chunk;
+    unsigned int i;
+    void* cpu_addr;
+
+    size = min(size, dmabuf_chunk_max());
+    if(table->vaddr != NULL) {
+        chunk.addr = table->vaddr + offset;
+        chunk.size = min(size, table->size - offset);
+        return chunk;
+    }
+
+    i = dmabuf_table_find(table, offset);
+    table_entry = &table->entries[i];
+    cpu_addr = dmabuf_table_cpu_addr(table, i, write);
+    chunk.size = table_entry->offset + table_entry->size - offset;
+    if(chunk.size > size) chunk.size = size;
+    if(cpu_addr != NULL) {
+        chunk.addr = cpu_addr + (offset - table_entry->offset);
+    }
+    else if(write) {
+        chunk.addr = NULL;
+    }
+    else {
+        chunk.addr = page_address(ZERO_PAGE(0));
+        chunk.size = min_t(size_t, chunk.size, PAGE_SIZE);
+    }
+
+    return chunk;
+}
+
+/**
+ * Get contiguous chunk of memory that ends at `end` (exclusive).
+ */
+static
+struct dmabuf_chunk dmabuf_table_chunk_before(struct dmabuf_table* table, size_t end, size_t size, bool write) {
+    struct dmabuf_table_entry* table_entry;
+    struct dmabuf_chunk chunk;
+    unsigned int i;
+    void* cpu_addr;
+
+    size = min(size, dmabuf_chunk_max());
+    if(table->vaddr != NULL) {
+        chunk.size = min(size, end);
+        chunk.addr = table->vaddr + end - chunk.size;
+        return chunk;
+    }
+
+    i = dmabuf_table_find(table, end - 1);
+    table_entry = &table->entries[i];
+    cpu_addr = dmabuf_table_cpu_addr(table, i, write);
+    chunk.size = end - table_entry->offset;
+    if(chunk.size > size) chunk.size = size;
+    if(cpu_addr != NULL) {
+        chunk.addr = cpu_addr + (end - table_entry->offset) - chunk.size;
+    }
+    else if(write) {
+        chunk.addr = NULL;
+    }
+    else {
+        chunk.size = min_t(size_t, chunk.size, PAGE_SIZE);
+        chunk.addr = page_address(ZERO_PAGE(0));
+    }
+
+    return chunk;
+}
+
+/**
+ * Assign DMA addresses of mapped sg_table to entries
+ * (entries are in the order of the sg_table pages).
+ *
+ * Each entry gets the address in the DMA segment where it starts
+ * (`offset` is relative to the start of current segment).
+ *
+ * @param entries - list of entries
+ * @param sgt - mapped sg_table
+ * @param last - last entry to assign (NULL - all entries)
+ */
+static
+void dmabuf_entries_set_dma(struct list_head* entries, struct sg_table* sgt, struct dmabuf_entry* last) {
+    struct dmabuf_entry* entry = list_first_entry(entries, struct dmabuf_entry, list_head);
+    struct scatterlist* sg;
+    size_t offset = 0;
+    int i;
+
+    for_each_sgtable_dma_sg(sgt, sg, i) {
+        while(&entry->list_head != entries && offset < sg_dma_len(sg)) {
+            entry->dma_handle = sg_dma_address(sg) + offset;
+            offset += entry->size;
+            if(entry == last) return;
+            entry = list_next_entry(entry, list_head);
+        }
+        offset -= sg_dma_len(sg);
+    }
+}
+
+static
+void dmabuf_unmap_sgtable(struct dmabuf* dmabuf, struct sg_table* sgt) {
+    if(sgt->sgl == NULL) return;
+    dma_unmap_sgtable(dmabuf->dev, sgt, DMA_BIDIRECTIONAL, 0);
+    sg_free_table(sgt);
+    memset(sgt, 0, sizeof(*sgt));
+}
+
+/**
+ * Map page entries with dma_map_sgtable (IOMMU mode).
+ *
+ * The IOMMU maps all entries (up to and including `last`)
+ * into one contiguous IOVA range
+ * and the dma_handle of each entry is set to its address in this range.
+ * On success the previous mapping (if any) is moved to `old`,
+ * such that the caller unmaps it (dmabuf_unmap_sgtable)
+ * after the table with the old DMA addresses is replaced.
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param last - last entry to map
+ * @param old - previous mapping (NULL - unmap it now)
+ *
+ * @retval - errors from sg_alloc_table and dma_map_sgtable
+ */
+static
+int dmabuf_map_sgtable(struct dmabuf* dmabuf, struct dmabuf_entry* last, struct sg_table* old) {
+    int error;
+    struct sg_table sgt;
+    struct dmabuf_entry* entry;
+    struct scatterlist* sg;
+    unsigned int nEntries = 0;
+
+    list_for_each_entry(entry, &dmabuf->entries, list_head) {
+        nEntries += 1;
+        if(entry == last) break;
+    }
+
+    error = sg_alloc_table(&sgt, nEntries, GFP_KERNEL);
+    if(error) {
+        M_ERR("sg_alloc_table(nents = %u): error = %d\n", nEntries, error);
+        return error;
+    }
+
+    sg = sgt.sgl;
+    list_for_each_entry(entry, &dmabuf->entries, list_head) {
+        sg_set_page(sg, entry->page, entry->size, 0);
+        if(entry == last) break;
+        sg = sg_next(sg);
+    }
+
+    error = dma_map_sgtable(dmabuf->dev, &sgt, DMA_BIDIRECTIONAL, 0);
+    if(error) {
+        M_ERR("dma_map_sgtable(nents = %u): error = %d\n", nEntries, error);
+        sg_free_table(&sgt);
+        return error;
+    }
+
+    dmabuf_entries_set_dma(&dmabuf->entries, &sgt, last);
+
+    if(old != NULL) *old = dmabuf->sgt;
+    else dmabuf_unmap_sgtable(dmabuf, &dmabuf->sgt);
+    dmabuf->sgt = sgt;
+
+    return 0;
+}
+
+/**
+ * Undo dmabuf_map_sgtable (on error).
+ *
+ * @param old - previous mapping (see dmabuf_map_sgtable)
+ * @param entries - entries to assign DMA addresses of previous mapping again (NULL - not changed)
+ */
+static
+void dmabuf_map_sgtable_revert(struct dmabuf* dmabuf, struct sg_table* old, struct list_head* entries) {
+    dmabuf_unmap_sgtable(dmabuf, &dmabuf->sgt);
+    dmabuf->sgt = *old;
+    memset(old, 0, sizeof(*old));
+    if(entries != NULL && dmabuf->sgt.sgl != NULL) dmabuf_entries_set_dma(entries, &dmabuf->sgt, NULL);
+}
+
+static
+void dmabuf_entries_free(struct dmabuf* dmabuf, struct list_head* entries) {
+    struct dmabuf_entry* entry, *tmp;
+
+    list_for_each_entry_safe(entry, tmp, entries, list_head) {
+        list_del(&entry->list_head);
+        dmabuf_entry_free(dmabuf, entry);
+    }
+}
+
+/**
+ * Move entries after `last` from the buffer list to `released`.
+ */
+static
+void dmabuf_entries_cut(struct dmabuf* dmabuf, struct dmabuf_entry* last, struct list_head* released) {
+    while(!list_is_last(&last->list_head, &dmabuf->entries)) {
+        list_move_tail(last->list_head.next, released);
+    }
+}
+
+/**
+ * Allocate empty table with `count` entries (and dirty bitmap).
+ *
+ * @return - pointer to struct dmabuf_table or NULL if out of memory or `count` does not fit table->count
+ */
+static
+struct dmabuf_table* dmabuf_table_kvzalloc(struct dmabuf* dmabuf, size_t count, size_t size) {
+    struct dmabuf_table* table;
+    size_t dirty_bits = dmabuf_dirty_bits(size, dmabuf->dirty_shift);
+
+    if(count > UINT_MAX) {
+        M_ERR("count = %zu > UINT_MAX\n", count);
+        return NULL;
+    }
+
+    // dirty bitmap follows the entries
+    table = kvzalloc(sizeof(*table) + count * sizeof(table->entries[0]) + BITS_TO_LONGS(dirty_bits) * sizeof(long), GFP_KERNEL);
+    if(table == NULL) {
+        M_ERR("kvzalloc(count = %zu): error = %d\n", count, -ENOMEM);
+        return NULL;
+    }
+
+    table->dmabuf = dmabuf;
+    table->size = size;
+    table->count = count;
+    if(dmabuf->dirty_shift != 0) {
+        table->dirty_shift = dmabuf->dirty_shift;
+        table->dirty = (unsigned long*)&table->entries[count];
+    }
+
+    return table;
+}
+
+/**
+ * Get page `k` of entry memory.
+ *
+ * Pages of dma_alloc_coherent memory are found through its kernel address
+ * (linear map, or vmalloc area if remapped, e.g. by dma-iommu),
+ * the DMA address may be an IOVA and does not give the physical address.
+ *
+ * @return - page or NULL if not backed by struct page (e.g. remapped device memory)
+ */
+static
+struct page* dmabuf_entry_page(struct dmabuf_entry* entry, size_t k) {
+    void* addr = entry->cpu_addr + (k << PAGE_SHIFT);
+    struct page* page;
+
+    if(entry->page != NULL) return pfn_to_page(page_to_pfn(entry->page) + k);
+    if(entry->cpu_addr == NULL) return NULL;
+    if(!is_vmalloc_addr(addr)) return virt_addr_valid(addr) ? virt_to_page(addr) : NULL;
+    page = vmalloc_to_page(addr);
+    return page != NULL && pfn_valid(page_to_pfn(page)) ? page : NULL;
+}
+
+/**
+ * Get pfn of page `k` of entry memory (see dmabuf_entry_page).
+ *
+ * Remapped memory without struct page (e.g. per-device coherent pool)
+ * is found through the page tables of its kernel address.
+ *
+ * @return - pfn or 0 if the memory is not accessed by the CPU
+ */
+static
+unsigned long dmabuf_entry_pfn(struct dmabuf_entry* entry, size_t k) {
+    struct page* page = dmabuf_entry_page(entry, k);
+
+    if(page != NULL) return page_to_pfn(page);
+    if(entry->cpu_addr == NULL || !is_vmalloc_addr(entry->cpu_addr + (k << PAGE_SHIFT))) return 0;
+    return vmalloc_to_pfn(entry->cpu_addr + (k << PAGE_SHIFT));
+}
+
+/**
+ * Map entries of table into one linear kernel address range.
+ *
+ * The pages of all entries are mapped with vmap (PAGE_KERNEL),
+ * such that in-kernel copies are single range operations
+ * (see dmabuf_table_chunk) instead of per entry copies.
+ * The mapping uses small pages (vmap of arbitrary pages is not mapped with huge pages).
+ * Not mapped (fall back to `cpu_addr` of entries) if disabled (`dmabuf_vmap`),
+ * in sparse mode, for imported dma-buf, if entries are not backed by struct page,
+ * or for dma_alloc_coherent memory of non-coherent devices
+ * (a cached alias of uncached memory is not allowed).
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param table - table with all entries set
+ *
+ * @return - kernel address or NULL if not mapped
+ */
+static
+void* dmabuf_table_vmap(struct dmabuf* dmabuf, struct dmabuf_table* table) {
+    size_t count = table->size >> PAGE_SHIFT, n = 0;
+    struct page** pages;
+    void* vaddr = NULL;
+
+    if(!dmabuf_vmap || table->sparse || count == 0 || count > UINT_MAX) return NULL;
+
+    pages = kvmalloc_array(count, sizeof(*pages), GFP_KERNEL);
+    if(pages == NULL) return NULL;
+
+    for(unsigned int i = 0; i < table->count && n < count; i++) {
+        struct dmabuf_entry* entry = table->entries[i].entry;
+        // dma-buf memory is not accessed by the CPU
+        if(entry->foreign) goto out_free;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0) // `dma-map-ops.h`
+        if(entry->page == NULL && !dev_is_dma_coherent(dmabuf->dev)) goto out_free;
+#endif
+        for(size_t k = 0; k < entry->size >> PAGE_SHIFT && n < count; k++) {
+            struct page* page = dmabuf_entry_page(entry, k);
+            if(page == NULL) goto out_free;
+            pages[n++] = page;
+        }
+    }
+    if(n != count) goto out_free;
+
+    vaddr = vmap(pages, count, VM_MAP, PAGE_KERNEL);
+    if(vaddr == NULL) M_INFO("vmap(count = %zu) failed, use entries\n", count);
+
+out_free:
+    kvfree(pages);
+    return vaddr;
+}
+
+static
+void dmabuf_table_free(struct dmabuf_table* table) {
+    if(table == NULL) return;
+    if(table->vaddr != NULL) vunmap(table->vaddr);
+    kvfree(table);
+}
+
+/**
+ * Build table of entries (up to and including `last`).
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param last - last entry (NULL - all entries)
+ * @param size - buffer size
+ *
+ * @return - pointer to struct dmabuf_table or NULL if out of memory
+ */
+static
+struct dmabuf_table* dmabuf_table_alloc(struct dmabuf* dmabuf, struct dmabuf_entry* last, size_t size) {
+    struct dmabuf_table* table;
+    struct dmabuf_entry* entry;
+    unsigned int count = 0;
+    size_t offset = 0;
+
+    list_for_each_entry(entry, &dmabuf->entries, list_head) {
+        count += 1;
+        if(entry == last) break;
+    }
+
+    table = dmabuf_table_kvzalloc(dmabuf, count, size);
+    if(table == NULL) return NULL;
+
+    count = 0;
+    list_for_each_entry(entry, &dmabuf->entries, list_head) {
+        table->entries[count].offset = offset;
+        table->entries[count].size = entry->size;
+        table->entries[count].cpu_addr = entry->cpu_addr;
+        table->entries[count].dma_addr = entry->dma_handle;
+        table->entries[count].entry = entry;
+        if(entry->foreign) table->foreign = true;
+        offset += entry->size;
+        count += 1;
+        if(entry == last) break;
+    }
+    table->vaddr = dmabuf_table_vmap(dmabuf, table);
+    // unmapped after the table is retired (see dmabuf_unmap_sgtable)
+    table->sgt = dmabuf->sgt;
+
+    return table;
+}
+
+/**
+ * Build table of empty slots of size dmabuf_entry_size_max (sparse mode).
+ *
+ * The size is only reserved (see dmabuf_size_check),
+ * such that it is bounded by DMABUF_BANK_OFFSET(1) here.
+ *
+ * @return - pointer to struct dmabuf_table or NULL if out of memory or size is too large
+ */
+static
+struct dmabuf_table* dmabuf_sparse_table_alloc(struct dmabuf* dmabuf, size_t size) {
+    struct dmabuf_table* table;
+    size_t slot = dmabuf_entry_size_max();
+
+    if((u64)size > DMABUF_BANK_OFFSET(1)) {
+        M_ERR("size = 0x%zx > DMABUF_BANK_OFFSET(1)\n", size);
+        return NULL;
+    }
+
+    table = dmabuf_table_kvzalloc(dmabuf, DIV_ROUND_UP(size, slot), size);
+    if(table == NULL) return NULL;
+
+    table->sparse = true;
+    for(unsigned int i = 0; i < table->count; i++) {
+        table->entries[i].offset = i * slot;
+        table->entries[i].size = slot;
+    }
+
+    return table;
+}
+
+// publish new table to readers (see dmabuf_table_replace), return the old one
+static
+struct dmabuf_table* dmabuf_table_publish(struct dmabuf* dmabuf, struct dmabuf_table* table) {
+    struct dmabuf_table* old = rcu_dereference_protected(dmabuf->table, true);
+
+    table->generation = old != NULL ? old->generation + 1 : 0;
+    rcu_assign_pointer(dmabuf->table, table);
+    WRITE_ONCE(dmabuf->size, table->size);
+
+    return old;
+}
+
+// wait for readers of the old table and free it
+static
+void dmabuf_table_retire(struct dmabuf* dmabuf, struct dmabuf_table* table, struct dmabuf_table* old) {
+    if(old == NULL) return;
+    synchronize_srcu(&dmabuf->srcu);
+    dmabuf_dirty_merge(table, old);
+    dmabuf_table_free(old);
+}
+
+/**
+ * Publish new table to readers and free the old one.
+ *
+ * On return no reader uses the old table
+ * (and entries that are not in the new table).
+ * Dirty bits of the old table are carried over.
+ * The caller must hold dmabuf->lock (or be the only user).
+ */
+static
+void dmabuf_table_replace(struct dmabuf* dmabuf, struct dmabuf_table* table) {
+    dmabuf_table_retire(dmabuf, table, dmabuf_table_publish(dmabuf, table));
+}
+
+/**
+ * Resize sparse buffer.
+ *
+ * Committed slots of the retained range are carried over to the new table,
+ * slots above new size are released.
+ * The new table is published under `commit_lock`,
+ * such that no slot is committed into the old table after it is copied.
+ *
+ * \code
+ * table = dmabuf_sparse_table_alloc(size)
+ * down_write(commit_lock)
+ * table->entries[i].entry = old->entries[i].entry
+ * dmabuf_table_publish(table)
+ * up_write(commit_lock)
+ * synchronize_srcu, unmap_mapping_range(mapping, size), free(released)
+ * \endcode
+ *
+ * The caller must hold dmabuf->lock.
+ *
+ * @retval -ENOMEM - out of memory
+ */
+static
+int dmabuf_sparse_resize(struct dmabuf* dmabuf, size_t size, struct address_space* mapping) {
+    struct dmabuf_table* table, *old;
+    size_t old_size = dmabuf->size;
+    LIST_HEAD(released);
+
+    table = dmabuf_sparse_table_alloc(dmabuf, size);
+    if(table == NULL) return -ENOMEM;
 
-struct dmabuf {
-    struct device* dev;
-    size_t size;
-    struct list_head entries;
-};
+    down_write(&dmabuf->commit_lock);
+    old = rcu_dereference_protected(dmabuf->table, true);
+    for(unsigned int i = 0; i < old->count; i++) {
+        struct dmabuf_entry* entry = old->entries[i].entry;
+        if(entry == NULL) continue;
+        if(i < table->count) table->entries[i].entry = entry;
+        else list_add_tail(&entry->list_head, &released);
+    }
+    if(size > old_size) {
+        // zero memory of the slot that is exposed again
+        struct dmabuf_table_entry* table_entry = &table->entries[old_size / dmabuf_entry_size_max()];
+        size_t end = min(table_entry->offset + table_entry->size, size);
+        if(table_entry->entry != NULL && old_size < end) {
+            memset(table_entry->entry->cpu_addr + (old_size - table_entry->offset), 0, end - old_size);
+        }
+        dmabuf_dirty_set(table, old_size, size - old_size);
+    }
+    dmabuf_table_publish(dmabuf, table);
+    up_write(&dmabuf->commit_lock);
+
+    // wait for read/write/fault handlers that use old table
+    dmabuf_table_retire(dmabuf, table, old);
+    if(size < old_size && mapping != NULL) unmap_mapping_range(mapping, size, old_size - size, 1);
+    dmabuf_entries_free(dmabuf, &released);
 
-static
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 70) // use const
-int dmabuf_entry_cmp(void* priv, const struct list_head* a, const struct list_head* b) {
-#else
-int dmabuf_entry_cmp(void* priv, struct list_head* a, struct list_head* b) {
-#endif
-    dma_addr_t aa = container_of(a, struct dmabuf_entry, list_head)->dma_handle;
-    dma_addr_t bb = container_of(b, struct dmabuf_entry, list_head)->dma_handle;
-    if(aa < bb) return -1;
-    if(aa > bb) return +1;
     return 0;
 }
 
 /**
- * Report contiguous DMA handles.
+ * Replace all entries of the buffer.
+ *
+ * New entries are mapped with dma_map_sgtable if `map` is set
+ * (IOMMU mode or imported pages).
+ * User mappings of the old buffer range `[0, old size)` are zapped
+ * (not the queue mapping at DMABUF_QUEUE_OFFSET),
+ * old entries are freed and imported memory is released (dmabuf->release).
+ * The caller must hold dmabuf->lock
+ * (and sets `imported` and `release` for the new entries).
+ *
+ * \code
+ * swap(dmabuf->entries, entries)
+ * if(map) dma_map_sgtable(dmabuf->entries)
+ * dmabuf_table_replace(dmabuf_table_alloc(size)) // + synchronize_srcu
+ * unmap_mapping_range(mapping, old_size), dma_unmap_sgtable(old), free(old entries)
+ * \endcode
  *
  * @param dmabuf - pointer to struct dmabuf
+ * @param entries - new entries (left untouched on error)
+ * @param size - new buffer size (not larger than size of entries)
+ * @param map - map entries with dma_map_sgtable
+ * @param mapping - address space of user mappings (device inode, see dmabuf_fs_inode_new)
  *
- * @return - number of contiguous DMA handles
+ * @retval -EOPNOTSUPP - in sparse mode (memory is owned by the slots)
+ * @retval -ENOMEM - out of memory
+ * @retval - errors from dma_map_sgtable
  */
 static
-int dmabuf_report(struct dmabuf* dmabuf) {
-    int n = 0;
-    struct dmabuf_entry* entry;
-    int nEntries = 0;
+int dmabuf_replace(struct dmabuf* dmabuf, struct list_head* entries, size_t size, bool map, struct address_space* mapping) {
+    int error;
+    struct dmabuf_table* table;
+    struct sg_table sgt = dmabuf->sgt; // old mapping
+    size_t old_size = dmabuf->size;
+    void (*release)(void*) = dmabuf->release;
+    LIST_HEAD(released);
 
-    if(IS_ERR_OR_NULL(dmabuf)) return -EFAULT;
+    if(dmabuf->sparse) return -EOPNOTSUPP;
 
-    list_for_each_entry(entry, &dmabuf->entries, list_head) {
-        dma_addr_t dma_handle = entry->dma_handle;
-        size_t size = entry->size;
-        // report consecutive entries as one entry
-        while(!list_is_last(&entry->list_head, &dmabuf->entries)) {
-            typeof(entry) next = list_next_entry(entry, list_head);
-            if(dma_handle + size != next->dma_handle) break;
-            size += next->size;
-            entry = next;
-        }
-        n++;
-        M_INFO("dma_handle = %pad, size = 0x%zx\n", &dma_handle, size);
+    // readers use the table (not the list)
+    list_splice_init(&dmabuf->entries, &released);
+    list_splice_init(entries, &dmabuf->entries);
+
+    // the table takes DMA addresses (and streaming mapping) of the new mapping
+    if(map) {
+        error = dmabuf_map_sgtable(dmabuf, list_last_entry(&dmabuf->entries, struct dmabuf_entry, list_head), &sgt);
+        if(error) goto err_swap;
     }
+    else memset(&dmabuf->sgt, 0, sizeof(dmabuf->sgt));
 
-    list_for_each_entry(entry, &dmabuf->entries, list_head) {
-        nEntries += 1;
+    table = dmabuf_table_alloc(dmabuf, NULL, size);
+    if(table == NULL) {
+        error = -ENOMEM;
+        if(map) dmabuf_map_sgtable_revert(dmabuf, &sgt, NULL);
+        else dmabuf->sgt = sgt;
+        goto err_swap;
     }
-    M_INFO("-> %d dma_handle entries\n", nEntries);
 
-    return n;
+    // all content is new
+    dmabuf_dirty_set(table, 0, size);
+    dmabuf_table_replace(dmabuf, table);
+    // mappings are bounded by the old size (see dmabuf_mmap)
+    if(mapping != NULL && old_size != 0) unmap_mapping_range(mapping, 0, old_size, 1);
+
+    // no reader uses the old DMA addresses
+    dmabuf_unmap_sgtable(dmabuf, &sgt);
+    dmabuf_entries_free(dmabuf, &released);
+    if(release != NULL) release(dmabuf->release_data);
+    dmabuf->release = NULL;
+    dmabuf->release_data = NULL;
+    dmabuf->imported = false;
+
+    return 0;
+
+err_swap:
+    list_splice_init(&dmabuf->entries, entries);
+    list_splice_init(&released, &dmabuf->entries);
+    return error;
 }
 
 static
 void dmabuf_free(struct dmabuf* dmabuf) {
-    struct dmabuf_entry* entry, *tmp;
+    struct dmabuf_table* table;
 
     if(IS_ERR_OR_NULL(dmabuf)) return;
 
     M_INFO("\n");
 
-    list_for_each_entry_safe(entry, tmp, &dmabuf->entries, list_head) {
-        list_del(&entry->list_head);
-        M_DEBUG("dma_free_coherent(dma_handle = %pad, size = 0x%zx)\n", &entry->dma_handle, entry->size);
-        dma_free_coherent(dmabuf->dev, entry->size, entry->cpu_addr, entry->dma_handle);
-        kfree(entry);
+    dmabuf_unmap_sgtable(dmabuf, &dmabuf->sgt);
+
+    table = rcu_dereference_protected(dmabuf->table, true);
+    // committed slots (sparse mode) are not in the list
+    for(unsigned int i = 0; table != NULL && table->sparse && i < table->count; i++) {
+        if(table->entries[i].entry != NULL) dmabuf_entry_free(dmabuf, table->entries[i].entry);
     }
+    // unmap linear mapping before entries are freed
+    dmabuf_table_free(table);
+    dmabuf_entries_free(dmabuf, &dmabuf->entries);
+    if(dmabuf->release != NULL) dmabuf->release(dmabuf->release_data);
 
+    cleanup_srcu_struct(&dmabuf->srcu);
+    mutex_destroy(&dmabuf->lock);
     kfree(dmabuf);
 }
 
 /**
- * Allocate DMA buffer.
+ * Allocate entries that back `size` bytes.
  *
- * Use dma_alloc_coherent to allocate list of struct dmabuf_entry objects
- * that back the requested size of the DMA buffer.
+ * Use dma_alloc_coherent to allocate list of struct dmabuf_entry objects.
+ * In IOMMU mode the entries are allocated with alloc_pages
+ * (and mapped later with dma_map_sgtable).
  *
- * The list is sorted by dma_handle
+ * Each entry is allocated with the largest power of 2 size
+ * that does not exceed the remaining size.
+ * The entry size is halved on failure and doubled again after success,
+ * such that the buffer consists of as few entries as possible
+ * and no memory above requested size is allocated.
+ * Large entries are allocated with `__GFP_NORETRY`
+ * (or `__GFP_RETRY_MAYFAIL` that allows compaction if `dmabuf_compact` is set).
+ *
+ * Without IOMMU the list is sorted by dma_handle
  * such that contiguous ranges can be combined
  * when passing handle and size to the device.
  *
  * \code
+ * while(allocated < size) {
+ *     entry_size = min(entry_size, rounddown_pow_of_two(size - allocated))
+ *     if(dma_alloc_coherent(entry_size)) entry_size *= 2, list_add(entries)
+ *     else entry_size /= 2
+ * }
+ * list_sort(entries, (a, b) { a->dma_handle < b->dma_handle })
+ * \endcode
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param entries - list to add new entries to (the caller frees it on error)
+ * @param size - size to allocate (multiple of page size)
+ *
+ * @retval -ENOMEM - out of memory (kzalloc, dma_alloc_coherent or alloc_pages)
+ */
+static
+int dmabuf_entries_alloc(struct dmabuf* dmabuf, struct list_head* entries, size_t size) {
+    int error;
+    size_t entry_size = dmabuf_entry_size_max();
+    size_t allocated = 0;
+
+    while(allocated < size) {
+        struct dmabuf_entry* entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+        if(IS_ERR_OR_NULL(entry)) {
+            if(entry == NULL) error = -ENOMEM;
+            else error = PTR_ERR(entry);
+            entry = NULL;
+            M_ERR("kzalloc: error = %d\n", error);
+            return error;
+        }
+
+        while(entry->cpu_addr == NULL) {
+            gfp_t gfp = GFP_KERNEL;
+            // largest power of 2 that fits into remaining size
+            entry->size = min_t(size_t, entry_size, rounddown_pow_of_two(size - allocated));
+            if(entry->size > PAGE_SIZE) {
+                // fail fast and fall back to smaller entry
+                gfp |= __GFP_NOWARN;
+                gfp |= dmabuf_compact ? __GFP_RETRY_MAYFAIL : __GFP_NORETRY;
+            }
+            error = dmabuf_entry_alloc(dmabuf, entry, gfp);
+            if(error) {
+                M_DEBUG("dmabuf_entry_alloc(size = 0x%zx): error = %d\n", entry->size, error);
+                if(entry->size <= PAGE_SIZE) {
+                    M_ERR("dmabuf_entry_alloc(size = 0x%zx): error = %d\n", entry->size, error);
+                    kfree(entry);
+                    return error;
+                }
+                // reduce allocation order and try again
+                entry_size = entry->size / 2;
+            }
+        }
+
+        INIT_LIST_HEAD(&entry->list_head);
+        list_add(&entry->list_head, entries);
+
+        allocated += entry->size;
+
+        // larger blocks may be available again
+        if(entry->size == entry_size && entry_size < dmabuf_entry_size_max()) entry_size *= 2;
+    }
+
+    // sort by dma_handle
+    if(!dmabuf->iommu) list_sort(NULL, entries, dmabuf_entry_cmp);
+
+    return 0;
+}
+
+/**
+ * Allocate DMA buffer.
+ *
+ * Allocate entries (see dmabuf_entries_alloc) that back the requested size.
+ * If the device is behind IOMMU (and `dmabuf_iommu` is set),
+ * the entries are mapped into one contiguous IOVA range with dma_map_sgtable.
+ * In sparse mode (`dmabuf_sparse`) only the table of empty slots is allocated
+ * and each slot is allocated with dma_alloc_coherent on first touch.
+ *
+ * \code
  * dmabuf = kzalloc()
- * while(dmabuf->size < size) list_add(dma_alloc_coherent(), &dmabuf->entries)
- * list_sort(&dmabuf->entries, (a, b) { a->dma_handle < b->dma_handle })
+ * dmabuf_entries_alloc(&dmabuf->entries, size)
+ * if(iommu) dma_map_sgtable(dmabuf->entries)
+ * dmabuf->table = dmabuf_table_alloc(dmabuf->entries)
  * \endcode
  *
  * @param dev - associated struct device pointer
@@ -158,20 +1405,21 @@ void dmabuf_free(struct dmabuf* dmabuf) {
  *
  * @return - pointer to struct dmabuf
  *
- * @retval -EINVAL - if size is 0 or not multiple of page size
- * @retval -ENOMEM - out of memory (kzalloc or dma_alloc_coherent)
+ * @retval -EINVAL - if size is 0, not multiple of page size or larger than DMABUF_BANK_OFFSET(1)
+ * @retval -ENOMEM - out of memory (kzalloc, dma_alloc_coherent or alloc_pages)
+ * @retval - errors from init_srcu_struct and dma_map_sgtable
  */
 static
 struct dmabuf* dmabuf_alloc(struct device* dev, size_t size) {
     int error;
-    size_t entry_size = min(PMD_SIZE, PAGE_SIZE << 12); // start from min of PMD (2 MiB) and 4096 pages (16 MiB)
     struct dmabuf* dmabuf;
+    struct dmabuf_table* table;
 
     if(dev == NULL) return ERR_PTR(-EFAULT);
 
     M_INFO("size = 0x%zx\n", size);
 
-    if(size == 0 || !IS_ALIGNED(size, PAGE_SIZE)) {
+    if(size == 0 || !IS_ALIGNED(size, PAGE_SIZE) || (u64)size > DMABUF_BANK_OFFSET(1)) {
         return ERR_PTR(-EINVAL);
     }
 
@@ -179,52 +1427,49 @@ struct dmabuf* dmabuf_alloc(struct device* dev, size_t size) {
     if(IS_ERR_OR_NULL(dmabuf)) {
         if(dmabuf == NULL) error = -ENOMEM;
         else error = PTR_ERR(dmabuf);
-        dmabuf = NULL;
         M_ERR("kzalloc: error = %d\n", error);
-        goto err_out;
+        return ERR_PTR(error);
+    }
+
+    error = init_srcu_struct(&dmabuf->srcu);
+    if(error) {
+        M_ERR("init_srcu_struct: error = %d\n", error);
+        kfree(dmabuf);
+        return ERR_PTR(error);
     }
+    mutex_init(&dmabuf->lock);
+    init_rwsem(&dmabuf->commit_lock);
 
     dmabuf->dev = dev;
     INIT_LIST_HEAD(&dmabuf->entries);
+    dmabuf->sparse = dmabuf_sparse;
+    // slots are allocated one by one (no common IOVA range)
+    dmabuf->iommu = !dmabuf->sparse && dmabuf_iommu && device_iommu_mapped(dev);
+    M_INFO("iommu = %d, sparse = %d\n", dmabuf->iommu, dmabuf->sparse);
+    if(dmabuf_dirty_granule != 0) {
+        dmabuf->dirty_shift = max_t(unsigned int, order_base_2(dmabuf_dirty_granule), PAGE_SHIFT);
+        M_INFO("dirty granule = 0x%lx\n", 1ul << dmabuf->dirty_shift);
+    }
 
-    while(dmabuf->size < size) {
-        struct dmabuf_entry* entry = kzalloc(sizeof(*entry), GFP_KERNEL);
-        if(IS_ERR_OR_NULL(entry)) {
-            if(entry == NULL) error = -ENOMEM;
-            else error = PTR_ERR(entry);
-            entry = NULL;
-            M_ERR("kzalloc: error = %d\n", error);
-            goto err_out;
-        }
+    if(dmabuf->sparse) {
+        table = dmabuf_sparse_table_alloc(dmabuf, size);
+    }
+    else {
+        error = dmabuf_entries_alloc(dmabuf, &dmabuf->entries, size);
+        if(error) goto err_out;
 
-        while(entry->cpu_addr == NULL) {
-            entry->size = entry_size;
-            M_DEBUG("dma_alloc_coherent(size = 0x%zx)\n", entry->size);
-            entry->cpu_addr = dma_alloc_coherent(dmabuf->dev, entry->size, &entry->dma_handle, GFP_KERNEL); // see `pci_alloc_consistent`
-            if(IS_ERR_OR_NULL(entry->cpu_addr)) {
-                if(entry->cpu_addr == NULL) error = -ENOMEM;
-                else error = PTR_ERR(entry->cpu_addr);
-                entry->cpu_addr = NULL;
-                M_ERR("dma_alloc_coherent(size = 0x%zx): error = %d\n", entry->size, error);
-                if(entry_size <= PAGE_SIZE) {
-                    kfree(entry);
-                    goto err_out;
-                }
-                // reduce allocation order and try again
-                entry_size /= 2;
-            }
+        if(dmabuf->iommu) {
+            error = dmabuf_map_sgtable(dmabuf, list_last_entry(&dmabuf->entries, struct dmabuf_entry, list_head), NULL);
+            if(error) goto err_out;
         }
 
-        INIT_LIST_HEAD(&entry->list_head);
-        list_add(&entry->list_head, &dmabuf->entries);
-
-        dmabuf->size += entry->size;
+        table = dmabuf_table_alloc(dmabuf, NULL, size);
     }
-    // TODO: don't expose memory above requested size
-    //dmabuf->size = size;
-
-    // sort by dma_handle
-    list_sort(NULL, &dmabuf->entries, dmabuf_entry_cmp);
+    if(table == NULL) {
+        error = -ENOMEM;
+        goto err_out;
+    }
+    dmabuf_table_replace(dmabuf, table);
 
     dmabuf_report(dmabuf);
 
@@ -235,72 +1480,363 @@ err_out:
     return ERR_PTR(error);
 }
 
+/**
+ * Resize DMA buffer.
+ *
+ * Grow - allocate new entries (see dmabuf_entries_alloc)
+ * and append them to the end of the list.
+ * Shrink - release entries above new size
+ * (an entry that crosses new size is kept, but not exposed).
+ *
+ * User mappings of the released range are zapped
+ * (next access raises SIGBUS),
+ * user mappings of the retained range stay valid.
+ * In IOMMU mode the entries are mapped again into a new IOVA range,
+ * i.e. the resize moves the whole buffer for the device
+ * (DMA addresses change and `generation` is incremented, see DMABUF_IOCTL_SEGMENTS).
+ * The old range is unmapped after the new table is published,
+ * the device must not access the buffer during resize
+ * (DMABUF_IOCTL_RESIZE is refused while ring readers are registered).
+ * Imported memory (see dmabuf_import.h) is released
+ * and replaced by newly allocated entries (see dmabuf_replace).
+ * In sparse mode only the table of slots changes (see dmabuf_sparse_resize).
+ *
+ * \code
+ * lock(dmabuf->lock)
+ * if(grow) list_add_tail(dmabuf_entries_alloc(size - capacity))
+ * if(iommu) dma_map_sgtable(entries)
+ * if(shrink) dmabuf_entries_cut(released)
+ * dmabuf_table_replace(dmabuf_table_alloc(size)) // + synchronize_srcu
+ * if(iommu) dma_unmap_sgtable(old)
+ * if(shrink) unmap_mapping_range(mapping, size), free(released)
+ * \endcode
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param size - new size of the buffer
+ * @param mapping - address space of user mappings (device inode, see dmabuf_fs_inode_new)
+ *
+ * @return - 0 on success
+ *
+ * @retval -EINVAL - if size is 0, not multiple of page size or too large (see dmabuf_size_check)
+ * @retval -EPERM - if size is larger than `max_size` (module parameter) without CAP_SYS_ADMIN
+ * @retval -ENOMEM - out of memory
+ * @retval - errors from dma_map_sgtable
+ */
+static
+int dmabuf_resize(struct dmabuf* dmabuf, size_t size, struct address_space* mapping) {
+    int error = 0;
+    size_t capacity = 0, offset = 0, old_size;
+    struct dmabuf_entry* entry, *last;
+    struct dmabuf_table* table;
+    struct sg_table sgt = { 0 }; // old mapping (IOMMU mode)
+    LIST_HEAD(entries);
+
+    if(dmabuf == NULL) return -EFAULT;
+
+    M_INFO("size = 0x%zx\n", size);
+
+    // sparse mode only reserves the size
+    error = dmabuf_size_check(size, !dmabuf->sparse);
+    if(error) return error;
+
+    mutex_lock(&dmabuf->lock);
+
+    old_size = dmabuf->size;
+    if(size == old_size && !dmabuf->imported) goto out_unlock;
+
+    if(dmabuf->sparse) {
+        error = dmabuf_sparse_resize(dmabuf, size, mapping);
+        if(error == 0) dmabuf_report(dmabuf);
+        goto out_unlock;
+    }
+
+    if(dmabuf->imported) {
+        error = dmabuf_entries_alloc(dmabuf, &entries, size);
+        if(error) goto err_free;
+        error = dmabuf_replace(dmabuf, &entries, size, dmabuf->iommu, mapping);
+        if(error) goto err_free;
+        dmabuf_report(dmabuf);
+        goto out_unlock;
+    }
+
+    list_for_each_entry(entry, &dmabuf->entries, list_head) {
+        capacity += entry->size;
+    }
+    last = list_last_entry(&dmabuf->entries, struct dmabuf_entry, list_head);
+
+    if(size > old_size) {
+        // zero memory of the entry that is exposed again
+        list_for_each_entry(entry, &dmabuf->entries, list_head) {
+            size_t begin = max(offset, old_size), end = min(offset + entry->size, size);
+            if(begin < end) memset(entry->cpu_addr + (begin - offset), 0, end - begin);
+            offset += entry->size;
+        }
+
+        if(size > capacity) {
+            error = dmabuf_entries_alloc(dmabuf, &entries, size - capacity);
+            if(error) goto err_free;
+            // new entries are not visible to readers until table is replaced
+            list_splice_tail_init(&entries, &dmabuf->entries);
+        }
+
+        if(dmabuf->iommu && size > capacity) {
+            error = dmabuf_map_sgtable(dmabuf, list_last_entry(&dmabuf->entries, struct dmabuf_entry, list_head), &sgt);
+            if(error) goto err_cut;
+        }
+
+        table = dmabuf_table_alloc(dmabuf, NULL, size);
+        if(table == NULL) {
+            error = -ENOMEM;
+            if(dmabuf->iommu && size > capacity) dmabuf_map_sgtable_revert(dmabuf, &sgt, &dmabuf->entries);
+            goto err_cut;
+        }
+
+        // zeroed and new memory
+        dmabuf_dirty_set(table, old_size, size - old_size);
+        dmabuf_table_replace(dmabuf, table);
+        // no reader uses the old DMA addresses
+        dmabuf_unmap_sgtable(dmabuf, &sgt);
+    }
+    else {
+        // last entry that is retained
+        list_for_each_entry(entry, &dmabuf->entries, list_head) {
+            offset += entry->size;
+            if(offset >= size) break;
+        }
+        last = entry;
+
+        if(dmabuf->iommu) {
+            error = dmabuf_map_sgtable(dmabuf, last, &sgt);
+            if(error) goto out_unlock;
+        }
+
+        table = dmabuf_table_alloc(dmabuf, last, size);
+        if(table == NULL) {
+            error = -ENOMEM;
+            if(dmabuf->iommu) dmabuf_map_sgtable_revert(dmabuf, &sgt, &dmabuf->entries);
+            goto out_unlock;
+        }
+
+        dmabuf_entries_cut(dmabuf, last, &entries);
+        // wait for read/write/fault handlers that use old table
+        dmabuf_table_replace(dmabuf, table);
+        // the device does not reach released entries through the old range
+        dmabuf_unmap_sgtable(dmabuf, &sgt);
+        if(mapping != NULL) unmap_mapping_range(mapping, size, old_size - size, 1);
+        dmabuf_entries_free(dmabuf, &entries);
+    }
+
+    dmabuf_report(dmabuf);
+
+out_unlock:
+    mutex_unlock(&dmabuf->lock);
+    return error;
+
+err_cut:
+    dmabuf_entries_cut(dmabuf, last, &entries);
+err_free:
+    dmabuf_entries_free(dmabuf, &entries);
+    mutex_unlock(&dmabuf->lock);
+    return error;
+}
+
+/**
+ * Set file position inside the buffer.
+ *
+ * @param base - file offset of the buffer (DMABUF_BANK_OFFSET of the bank)
+ *
+ * @retval -EINVAL - if the new position is outside of the buffer
+ */
 static
-loff_t dmabuf_llseek(struct dmabuf* dmabuf, struct file* file, loff_t loff, int whence) {
+loff_t dmabuf_llseek(struct dmabuf* dmabuf, struct file* file, loff_t loff, int whence, loff_t base) {
     loff_t loff_new;
 
     if(dmabuf == NULL) return -EFAULT;
 
     switch(whence) {
     case SEEK_CUR:
-        loff_new = file->f_pos + loff;
+        loff_new = file->f_pos - base + loff;
         break;
     case SEEK_END:
-        loff_new = dmabuf->size + loff;
+        loff_new = READ_ONCE(dmabuf->size) + loff;
         break;
     case SEEK_SET:
-        loff_new = loff;
+        loff_new = loff - base;
         break;
     default:
         loff_new = -1;
     }
 
-    if(!(0 <= loff_new && loff_new <= dmabuf->size)) {
+    if(!(0 <= loff_new && loff_new <= READ_ONCE(dmabuf->size))) {
         M_ERR("loff = 0x%llx, whence = %d\n", loff, whence);
         return -EINVAL;
     }
 
-    file->f_pos = loff_new;
+    file->f_pos = base + loff_new;
     return file->f_pos;
 }
 
+/**
+ * Get offset in buffer of page `pgoff` of the device file.
+ *
+ * `vm_pgoff` of user mappings is the file offset
+ * (including DMABUF_BANK_OFFSET of the bank),
+ * such that unmap_mapping_range at the file offset of a bank
+ * zaps the mappings of this bank only.
+ * A mapping does not cross banks (see dmabuf_mmap).
+ */
+static
+size_t dmabuf_pgoff_offset(pgoff_t pgoff) {
+    return (size_t)(pgoff & ((DMABUF_BANK_OFFSET(1) >> PAGE_SHIFT) - 1)) << PAGE_SHIFT;
+}
+
+/**
+ * Handle page fault in user mapping.
+ *
+ * Insert pfn of the faulting page
+ * and of the rest of its entry (inside the vma and inside the `PMD_SIZE` window
+ * around the faulting address, such that large entries are not mapped at once)
+ * with vmf_insert_pfn.
+ * The pfn of each page is taken from the kernel address of the entry
+ * (see dmabuf_entry_pfn), the DMA address may be an IOVA
+ * and memory of dma_alloc_coherent may be a non-contiguous remap.
+ * Not committed slots (sparse mode) are allocated.
+ *
+ * @retval VM_FAULT_SIGBUS - if offset is above buffer size, the buffer is imported dma-buf
+ *                           or slot could not be committed (out of memory or the buffer was shrunk)
+ */
+static
+vm_fault_t dmabuf_vm_fault(struct vm_fault* vmf) {
+    struct vm_area_struct* vma = vmf->vma;
+    struct dmabuf* dmabuf = vma->vm_private_data;
+    struct dmabuf_table* table;
+    struct dmabuf_table_entry* table_entry;
+    struct dmabuf_entry* entry;
+    unsigned int i;
+    size_t offset = dmabuf_pgoff_offset(vmf->pgoff);
+    size_t vma_offset = dmabuf_pgoff_offset(vma->vm_pgoff);
+    size_t vma_end = vma_offset + (vma->vm_end - vma->vm_start);
+    size_t begin, end;
+    unsigned long pfn;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
+    int idx;
+
+    idx = srcu_read_lock(&dmabuf->srcu);
+    table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+
+    if(vma_end > table->size) vma_end = table->size;
+    if(offset >= vma_end || table->foreign) goto out_unlock;
+
+    i = dmabuf_table_find(table, offset);
+    table_entry = &table->entries[i];
+    // not VM_FAULT_OOM - the OOM killer does not help a reservation that can not be backed
+    entry = dmabuf_table_entry(table, i, true);
+    if(entry == NULL) goto out_unlock;
+    pfn = dmabuf_entry_pfn(entry, (offset - table_entry->offset) >> PAGE_SHIFT);
+    if(pfn == 0) goto out_unlock;
+
+    ret = vmf_insert_pfn(vma, vmf->address, pfn);
+    if(ret & VM_FAULT_ERROR) goto out_unlock;
+
+    // map the rest of the entry (bounded by the PMD window)
+    begin = max3(table_entry->offset, vma_offset, round_down(offset, PMD_SIZE));
+    end = min3(table_entry->offset + table_entry->size, vma_end, round_down(offset, PMD_SIZE) + PMD_SIZE);
+    for(; begin < end; begin += PAGE_SIZE) {
+        if(begin == offset) continue;
+        pfn = dmabuf_entry_pfn(entry, (begin - table_entry->offset) >> PAGE_SHIFT);
+        if(pfn == 0) break;
+        if(vmf_insert_pfn(vma, vma->vm_start + (begin - vma_offset), pfn) & VM_FAULT_ERROR) break;
+    }
+
+out_unlock:
+    srcu_read_unlock(&dmabuf->srcu, idx);
+    return ret;
+}
+
+/**
+ * Handle first write to a write-protected page (dirty tracking).
+ *
+ * With dirty tracking the pages are mapped read-only
+ * (see `vma_wants_writenotify`) and write-protected again
+ * by DMABUF_IOCTL_DIRTY_GET, such that each first write after
+ * DMABUF_IOCTL_DIRTY_GET marks the page dirty.
+ * Returning 0 makes the pte writable.
+ */
+static
+vm_fault_t dmabuf_vm_pfn_mkwrite(struct vm_fault* vmf) {
+    struct dmabuf* dmabuf = vmf->vma->vm_private_data;
+    struct dmabuf_table* table;
+    size_t offset = dmabuf_pgoff_offset(vmf->pgoff);
+    vm_fault_t ret = 0;
+    int idx;
+
+    idx = srcu_read_lock(&dmabuf->srcu);
+    table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+    if(offset >= table->size) ret = VM_FAULT_SIGBUS;
+    else dmabuf_dirty_set(table, offset, PAGE_SIZE);
+    srcu_read_unlock(&dmabuf->srcu, idx);
+
+    return ret;
+}
+
+static const
+struct vm_operations_struct dmabuf_vm_ops = {
+    .fault = dmabuf_vm_fault,
+};
+
+static const
+struct vm_operations_struct dmabuf_vm_dirty_ops = {
+    .fault = dmabuf_vm_fault,
+    .pfn_mkwrite = dmabuf_vm_pfn_mkwrite,
+};
+
 /**
  * Map DMA buffer to user address space.
  *
- * Use pgprot_noncached to set page protection
- * and map each dmabuf_entry with remap_pfn_range.
+ * Use pgprot_noncached to set page protection.
+ * The entries are mapped on page fault (see dmabuf_vm_fault)
+ * such that the mappings can be zapped on resize.
  *
  * \code
  * vma->vm_page_prot = pgprot_dmacoherent()
- * for_each(entry : dmabuf->entries) remap_pfn_range(pfn(entry->dma_handle))
+ * vma->vm_ops = &dmabuf_vm_ops
  * \endcode
  *
  * @param dmabuf - pointer to struct dmabuf
- * @param vma - pointer to struct vm_area_struct
+ * @param vma - pointer to struct vm_area_struct (`vm_pgoff` - file offset, see dmabuf_pgoff_offset)
  *
  * @return - 0 on success
  *
- * @retval -EINVAL - if out of range
- * @retval - errors from remap_pfn_range
+ * @retval -EINVAL - if out of range or not shared mapping
+ * @retval -EOPNOTSUPP - if the buffer is imported dma-buf (no CPU access)
  */
 static
 int dmabuf_mmap(struct dmabuf* dmabuf, struct vm_area_struct* vma) {
-    int error;
-    typeof(vma->vm_start) vma_addr = vma->vm_start;
     size_t vma_size = vma->vm_end - vma->vm_start;
-    size_t offset = vma->vm_pgoff << PAGE_SHIFT;
-    struct dmabuf_entry* entry;
+    size_t offset = dmabuf_pgoff_offset(vma->vm_pgoff);
+    size_t size;
+    bool foreign;
+    int idx;
 
     if(dmabuf == NULL) return -EFAULT;
 
     M_INFO("vma_size = 0x%zx, offset = 0x%zx\n", vma_size, offset);
 
-    if(offset > dmabuf->size) return -EINVAL;
-    if(vma_size > dmabuf->size - offset) return -EINVAL;
+    idx = srcu_read_lock(&dmabuf->srcu);
+    foreign = srcu_dereference(dmabuf->table, &dmabuf->srcu)->foreign;
+    srcu_read_unlock(&dmabuf->srcu, idx);
+    if(foreign) return -EOPNOTSUPP;
+
+    size = READ_ONCE(dmabuf->size);
+    if(offset > size) return -EINVAL;
+    if(vma_size > size - offset) return -EINVAL;
+    // pfn mappings can not be copy-on-write
+    // (test VM_MAYSHARE - VM_SHARED is cleared for read-only files)
+    if(!(vma->vm_flags & VM_MAYSHARE)) return -EINVAL;
 
     vm_flags_clear(vma, VM_EXEC | VM_MAYEXEC);
     vm_flags_set(vma, 0
-        | VM_PFNMAP // pages are managed by remap_pfn_range
+        | VM_PFNMAP // pages are managed by vmf_insert_pfn
         | VM_IO // memory-mapped I/O
         | VM_DONTEXPAND // prevent mremap
         | VM_DONTDUMP // excludes from core dump
@@ -314,103 +1850,153 @@ int dmabuf_mmap(struct dmabuf* dmabuf, struct vm_area_struct* vma) {
     vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 #endif
 
-    // the mm semaphore is already held (by mmap)
-    list_for_each_entry(entry, &dmabuf->entries, list_head) {
-        phys_addr_t phys;
-        unsigned long pfn;
-        size_t size;
-        if(offset >= entry->size) {
-            offset -= entry->size;
-            continue;
-        }
-        size = entry->size - offset;
-        if(vma_size < size) size = vma_size;
-        if(size == 0) break;
-
-        phys = dma_to_phys(dmabuf->dev, entry->dma_handle) + offset;
-        pfn = PHYS_PFN(phys);
-
-        M_DEBUG("remap_pfn_range(pfn = 0x%lx, size = 0x%zx)\n", pfn, size);
-        error = remap_pfn_range(vma, vma_addr, pfn, size, vma->vm_page_prot);
-        if(error) {
-            M_ERR("remap_pfn_range(pfn = 0x%lx, size = 0x%zx): error = %d\n", pfn, size, error);
-            goto err_out;
-        }
-
-        vma_addr += size;
-        vma_size -= size;
-        offset = 0; // offset is 0 for next entry
-    }
-
-    if(vma_size != 0) return -EINVAL;
+    // `pfn_mkwrite` makes the mapping read-only until first write
+    vma->vm_ops = dmabuf->dirty_shift != 0 ? &dmabuf_vm_dirty_ops : &dmabuf_vm_ops;
+    vma->vm_private_data = dmabuf;
 
     return 0;
-
-err_out:
-    // kernel does the unmap in case of error
-    return error;
 }
 
+/**
+ * Copy from buffer to user space.
+ *
+ * Large transfers are split into chunks of at most `chunk` bytes
+ * (module parameter) with cond_resched between chunks,
+ * such that the CPU is not stalled by multi-GiB copies.
+ * With linear mapping chunks span entries (see dmabuf_table_chunk).
+ * Not committed slots (sparse mode) read as zeros (and are not allocated).
+ *
+ * @return - number of bytes copied (partial on fault or fatal signal, including bytes of the faulting chunk)
+ *
+ * @retval -EFAULT - if nothing was copied due to fault
+ * @retval -EOPNOTSUPP - if the buffer is imported dma-buf (no CPU access)
+ */
 static
 ssize_t dmabuf_read(struct dmabuf* dmabuf, char __user* user_buffer, size_t user_size, loff_t offset) {
     ssize_t n = 0;
-    struct dmabuf_entry* entry;
+    struct dmabuf_table* table;
+    size_t size, left, sync_offset, sync_size;
+    int idx;
 
     if(dmabuf == NULL) return -EFAULT;
     if(!access_ok(user_buffer, user_size)) return -EFAULT;
 
-    list_for_each_entry(entry, &dmabuf->entries, list_head) {
-        size_t size;
-        if(offset >= entry->size) {
-            offset -= entry->size;
-            continue;
-        }
-        size = entry->size - offset;
-        if(user_size < size) size = user_size;
-        if(size == 0) break;
+    idx = srcu_read_lock(&dmabuf->srcu);
+    table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+
+    // do not access memory above buffer size
+    if(offset >= table->size) user_size = 0;
+    else if(user_size > table->size - offset) user_size = table->size - offset;
+    if(table->foreign) {
+        user_size = 0;
+        n = -EOPNOTSUPP;
+    }
+
+    // the device may access the memory (streaming mapping)
+    sync_offset = offset;
+    sync_size = user_size;
+    dmabuf_table_sync_for_cpu(table, sync_offset, sync_size);
+
+    while(user_size > 0) {
+        struct dmabuf_chunk chunk = dmabuf_table_chunk(table, offset, user_size, false);
+        size = chunk.size;
 
         M_DEBUG("copy_to_user(size = 0x%zx)\n", size);
-        if(copy_to_user(user_buffer, entry->cpu_addr + offset, size) != 0) {
-            M_ERR("copy_to_user(size = 0x%zx) != 0\n", size);
-            return -EFAULT;
+        left = copy_to_user(user_buffer, chunk.addr, size);
+        if(left != 0) {
+            M_ERR("copy_to_user(size = 0x%zx): left = 0x%zx\n", size, left);
+            // bytes before the fault are copied
+            n += size - left;
+            if(n == 0) n = -EFAULT;
+            break;
         }
         n += size;
         user_buffer += size;
         user_size -= size;
-        offset = 0; // offset is 0 for next entry
+        offset += size;
+
+        // return partial progress on fatal signal
+        if(user_size > 0 && dmabuf_yield() != 0) break;
     }
 
+    dmabuf_table_sync_for_device(table, sync_offset, sync_size);
+    srcu_read_unlock(&dmabuf->srcu, idx);
+
     return n;
 }
 
+/**
+ * Copy from user space to buffer.
+ *
+ * Large transfers are split into chunks of at most `chunk` bytes
+ * (module parameter) with cond_resched between chunks,
+ * such that the CPU is not stalled by multi-GiB copies.
+ * With linear mapping chunks span entries (see dmabuf_table_chunk).
+ * Written chunks are marked dirty (see dmabuf_dirty_set).
+ * Not committed slots (sparse mode) are allocated.
+ *
+ * @return - number of bytes copied (partial on fault, fatal signal or out of memory, including bytes of the faulting chunk)
+ *
+ * @retval -EFAULT - if nothing was copied due to fault
+ * @retval -ENOMEM - if nothing was copied because slot could not be allocated
+ * @retval -EOPNOTSUPP - if the buffer is imported dma-buf (no CPU access)
+ */
 static
 ssize_t dmabuf_write(struct dmabuf* dmabuf, const char __user* user_buffer, size_t user_size, loff_t offset) {
     ssize_t n = 0;
-    struct dmabuf_entry* entry;
+    struct dmabuf_table* table;
+    size_t size, left, sync_offset, sync_size;
+    int idx;
 
     if(dmabuf == NULL) return -EFAULT;
     if(!access_ok(user_buffer, user_size)) return -EFAULT;
 
-    list_for_each_entry(entry, &dmabuf->entries, list_head) {
-        size_t size;
-        if(offset >= entry->size) {
-            offset -= entry->size;
-            continue;
-        }
-        size = entry->size - offset;
-        if(user_size < size) size = user_size;
-        if(size == 0) break;
+    idx = srcu_read_lock(&dmabuf->srcu);
+    table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+
+    // do not access memory above buffer size
+    if(offset >= table->size) user_size = 0;
+    else if(user_size > table->size - offset) user_size = table->size - offset;
+    if(table->foreign) {
+        user_size = 0;
+        n = -EOPNOTSUPP;
+    }
+
+    // the device may access the memory (streaming mapping)
+    sync_offset = offset;
+    sync_size = user_size;
+    dmabuf_table_sync_for_cpu(table, sync_offset, sync_size);
 
+    while(user_size > 0) {
+        struct dmabuf_chunk chunk = dmabuf_table_chunk(table, offset, user_size, true);
+        size = chunk.size;
+
+        if(chunk.addr == NULL) {
+            if(n == 0) n = -ENOMEM;
+            break;
+        }
         M_DEBUG("copy_from_user(size = 0x%zx)\n", size);
-        if(copy_from_user(entry->cpu_addr + offset, user_buffer, size) != 0) {
-            M_ERR("copy_from_user(size = 0x%zx) != 0\n", size);
-            return -EFAULT;
+        left = copy_from_user(chunk.addr, user_buffer, size);
+        if(left != 0) {
+            M_ERR("copy_from_user(size = 0x%zx): left = 0x%zx\n", size, left);
+            // bytes before the fault are written
+            dmabuf_dirty_set(table, offset, size - left);
+            n += size - left;
+            if(n == 0) n = -EFAULT;
+            break;
         }
+        dmabuf_dirty_set(table, offset, size);
         n += size;
         user_buffer += size;
         user_size -= size;
-        offset = 0; // offset is 0 for next entry
+        offset += size;
+
+        // return partial progress on fatal signal
+        if(user_size > 0 && dmabuf_yield() != 0) break;
     }
 
+    dmabuf_table_sync_for_device(table, sync_offset, sync_size);
+    srcu_read_unlock(&dmabuf->srcu, idx);
+
     return n;
 }
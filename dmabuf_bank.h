@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+#include "dmabuf.h"
+
+#include <linux/spinlock.h>
+
+#define DMABUF_BANKS_MAX 16
+
+static uint dmabuf_banks_count = 1;
+module_param_named(banks, dmabuf_banks_count, uint, 0444);
+MODULE_PARM_DESC(banks, "number of equally sized buffers for ping-pong mode (1 - 16)");
+
+/**
+ * Equally sized buffers (banks), one of them is active (filled by producer).
+ *
+ * Bank `i` is accessed at offset `DMABUF_BANK_OFFSET(i)`.
+ * `active` and `fill` are protected by `lock`,
+ * such that swap and commit are atomic with respect to each other.
+ */
+struct dmabuf_banks {
+    unsigned int count;
+    struct dmabuf* dmabuf[DMABUF_BANKS_MAX];
+
+    spinlock_t lock;
+    unsigned int active;
+    u64 fill; // fill level of active bank
+    u64 swaps;
+};
+
+static
+void dmabuf_banks_init(struct dmabuf_banks* banks) {
+    banks->count = 0;
+    spin_lock_init(&banks->lock);
+    banks->active = 0;
+    banks->fill = 0;
+    banks->swaps = 0;
+}
+
+/**
+ * Allocate banks 1 .. count - 1 of the same size as bank 0.
+ *
+ * @param banks - pointer to struct dmabuf_banks (with `dmabuf[0]` set)
+ * @param dev - associated struct device pointer
+ * @param count - number of banks
+ *
+ * @retval -EINVAL - if count is 0 or larger than DMABUF_BANKS_MAX
+ * @retval - errors from dmabuf_alloc
+ */
+static
+int dmabuf_banks_alloc(struct dmabuf_banks* banks, struct device* dev, unsigned int count) {
+    banks->count = 1;
+    if(count == 0 || count > DMABUF_BANKS_MAX) return -EINVAL;
+
+    for(unsigned int i = 1; i < count; i++) {
+        struct dmabuf* dmabuf = dmabuf_alloc(dev, banks->dmabuf[0]->size);
+        if(IS_ERR_OR_NULL(dmabuf)) {
+            int error = dmabuf == NULL ? -ENOMEM : PTR_ERR(dmabuf);
+            M_ERR("dmabuf_alloc(bank = %u): error = %d\n", i, error);
+            return error;
+        }
+        banks->dmabuf[i] = dmabuf;
+        banks->count = i + 1;
+    }
+
+    return 0;
+}
+
+// free banks 1 .. count - 1 (bank 0 is owned by the device)
+static
+void dmabuf_banks_free(struct dmabuf_banks* banks) {
+    for(unsigned int i = 1; i < banks->count; i++) dmabuf_free(banks->dmabuf[i]);
+    banks->count = 1;
+}
+
+/**
+ * Select bank by offset.
+ *
+ * @param offset - offset in device file (bank bits are removed)
+ *
+ * @return - bank or NULL if no such bank
+ */
+static
+struct dmabuf* dmabuf_banks_get(struct dmabuf_banks* banks, u64* offset) {
+    u64 i = *offset >> DMABUF_BANK_SHIFT;
+    if(i >= banks->count) return NULL;
+    *offset -= DMABUF_BANK_OFFSET(i);
+    return banks->dmabuf[i];
+}
+
+/**
+ * Add bytes to fill level of active bank.
+ *
+ * @retval -ENOSPC - if fill level would exceed bank size
+ */
+static
+int dmabuf_banks_commit(struct dmabuf_banks* banks, u64 size) {
+    int error = 0;
+
+    spin_lock(&banks->lock);
+    if(size > READ_ONCE(banks->dmabuf[banks->active]->size) - banks->fill) error = -ENOSPC;
+    else banks->fill += size;
+    spin_unlock(&banks->lock);
+
+    return error;
+}
+
+/**
+ * Make next bank active.
+ *
+ * \code
+ * swap->bank = active, swap->fill = fill
+ * active = (active + 1) % count, fill = 0
+ * \endcode
+ */
+static
+void dmabuf_banks_swap(struct dmabuf_banks* banks, struct dmabuf_bank_swap* swap) {
+    spin_lock(&banks->lock);
+    swap->bank = banks->active;
+    swap->fill = banks->fill;
+    banks->active = (banks->active + 1) % banks->count;
+    banks->fill = 0;
+    banks->swaps += 1;
+    swap->active = banks->active;
+    spin_unlock(&banks->lock);
+}
+
+/**
+ * Handle DMABUF_IOCTL_BANK_* commands
+ * and buffer commands of bank selected by `offset` (DMABUF_IOCTL_INFO, DMABUF_IOCTL_SEGMENTS).
+ *
+ * @retval -EINVAL - if `offset` is not DMABUF_BANK_OFFSET of a bank
+ * @retval -ENOTTY - if cmd is not a bank command
+ */
+static
+long dmabuf_banks_ioctl(struct dmabuf_banks* banks, unsigned int cmd, unsigned long arg) {
+    void __user* user_arg = (void __user*)arg;
+    struct dmabuf* dmabuf;
+    u64 offset;
+    int idx;
+
+    switch(cmd) {
+    case DMABUF_IOCTL_INFO: {
+        struct dmabuf_info info;
+        if(copy_from_user(&info, user_arg, sizeof(info)) != 0) return -EFAULT;
+        offset = info.offset;
+        dmabuf = dmabuf_banks_get(banks, &offset);
+        if(dmabuf == NULL || offset != 0) return -EINVAL;
+        offset = info.offset;
+        idx = srcu_read_lock(&dmabuf->srcu);
+        dmabuf_info(dmabuf, srcu_dereference(dmabuf->table, &dmabuf->srcu), &info, false);
+        srcu_read_unlock(&dmabuf->srcu, idx);
+        info.offset = offset;
+        if(copy_to_user(user_arg, &info, sizeof(info)) != 0) return -EFAULT;
+        return 0;
+    }
+    case DMABUF_IOCTL_SEGMENTS: {
+        struct dmabuf_segments segments;
+        ssize_t n;
+        if(copy_from_user(&segments, user_arg, sizeof(segments)) != 0) return -EFAULT;
+        offset = segments.offset;
+        dmabuf = dmabuf_banks_get(banks, &offset);
+        if(dmabuf == NULL || offset != 0) return -EINVAL;
+        idx = srcu_read_lock(&dmabuf->srcu);
+        n = dmabuf_segments(srcu_dereference(dmabuf->table, &dmabuf->srcu), u64_to_user_ptr(segments.segments), segments.count);
+        srcu_read_unlock(&dmabuf->srcu, idx);
+        if(n < 0) return n;
+        segments.count = n;
+        if(copy_to_user(user_arg, &segments, sizeof(segments)) != 0) return -EFAULT;
+        return 0;
+    }
+    case DMABUF_IOCTL_BANK_INFO: {
+        struct dmabuf_bank_info info = { 0 };
+        spin_lock(&banks->lock);
+        info.count = banks->count;
+        info.active = banks->active;
+        info.size = READ_ONCE(banks->dmabuf[0]->size);
+        info.fill = banks->fill;
+        info.swaps = banks->swaps;
+        spin_unlock(&banks->lock);
+        if(copy_to_user(user_arg, &info, sizeof(info)) != 0) return -EFAULT;
+        return 0;
+    }
+    case DMABUF_IOCTL_BANK_COMMIT: {
+        u64 size;
+        if(get_user(size, (u64 __user*)user_arg) != 0) return -EFAULT;
+        return dmabuf_banks_commit(banks, size);
+    }
+    case DMABUF_IOCTL_BANK_SWAP: {
+        struct dmabuf_bank_swap swap;
+        dmabuf_banks_swap(banks, &swap);
+        if(copy_to_user(user_arg, &swap, sizeof(swap)) != 0) return -EFAULT;
+        return 0;
+    }
+    }
+
+    return -ENOTTY;
+}
@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+#include "dmabuf.h"
+#include "dmabuf_bank.h"
+
+/**
+ * Get and clear up to 64 dirty bits starting at bit `first`.
+ *
+ * Each word of the bitmap is cleared with one atomic operation,
+ * such that bits set concurrently are either returned or kept.
+ */
+static
+u64 dmabuf_dirty_take(unsigned long* bitmap, size_t first, unsigned int n) {
+    u64 value = 0;
+
+    for(unsigned int k = 0; k < n; ) {
+        unsigned long* word = &bitmap[BIT_WORD(first + k)];
+        unsigned int shift = (first + k) % BITS_PER_LONG;
+        unsigned int bits = min_t(unsigned int, BITS_PER_LONG - shift, n - k);
+        unsigned long mask = GENMASK(shift + bits - 1, shift);
+        if(READ_ONCE(*word) & mask) {
+            unsigned long old = atomic_long_fetch_andnot(mask, (atomic_long_t*)word);
+            value |= (u64)((old & mask) >> shift) << k;
+        }
+        k += bits;
+    }
+
+    return value;
+}
+
+// set bits again (e.g. if they could not be reported)
+static
+void dmabuf_dirty_restore(unsigned long* bitmap, size_t first, u64 value) {
+    for(unsigned int k = 0; k < 64; k++) {
+        if(value & BIT_ULL(k)) set_bit(first + k, bitmap);
+    }
+}
+
+/**
+ * Write-protect user mappings of range (next write calls `pfn_mkwrite`).
+ *
+ * Without CONFIG_MAPPING_DIRTY_HELPERS the range is unmapped
+ * (and mapped read-only again on next access).
+ */
+static
+void dmabuf_dirty_wrprotect(struct address_space* mapping, u64 offset, u64 size) {
+    if(mapping == NULL || size == 0) return;
+#if IS_ENABLED(CONFIG_MAPPING_DIRTY_HELPERS)
+    wp_shared_mapping_range(mapping, offset >> PAGE_SHIFT, size >> PAGE_SHIFT);
+#else
+    unmap_mapping_range(mapping, offset, size, 1);
+#endif
+}
+
+/**
+ * Report and clear dirty granules of range.
+ *
+ * The bits are cleared before the user mappings are write-protected,
+ * a write in between is not reported again,
+ * but is visible to the caller that reads the range after return.
+ * Contiguous runs of dirty granules are write-protected with one call.
+ *
+ * \code
+ * for(word in bitmap[offset, offset + size)) {
+ *     user_bitmap[i] = atomic_fetch_andnot(word)
+ *     wrprotect(mapping, runs of set bits)
+ * }
+ * \endcode
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param mapping - address space of user mappings (device inode, see dmabuf_fs_inode_new)
+ * @param mapping_offset - offset of the buffer in the mapping (bank offset)
+ * @param dirty - in: offset, size and bitmap, out: granule and count
+ *
+ * @retval -EOPNOTSUPP - if dirty tracking is disabled
+ * @retval -EINVAL - if offset is out of range or not multiple of granule
+ * @retval -EFAULT - if bitmap could not be written (bits not written are kept)
+ */
+static
+long dmabuf_dirty_get(struct dmabuf* dmabuf, struct address_space* mapping, u64 mapping_offset, struct dmabuf_dirty* dirty) {
+    long error = 0;
+    struct dmabuf_table* table;
+    u64 __user* user_bitmap = u64_to_user_ptr(dirty->bitmap);
+    u64 words[32];
+    u64 granule, size, wp_begin = 0, wp_end = 0;
+    size_t first, bits;
+    int idx;
+
+    idx = srcu_read_lock(&dmabuf->srcu);
+    table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+
+    if(table->dirty == NULL) {
+        error = -EOPNOTSUPP;
+        goto out_unlock;
+    }
+    granule = 1ull << table->dirty_shift;
+    if(!IS_ALIGNED(dirty->offset, granule) || dirty->offset > table->size) {
+        error = -EINVAL;
+        goto out_unlock;
+    }
+    size = min_t(u64, dirty->size, table->size - dirty->offset);
+    first = dirty->offset >> table->dirty_shift;
+    bits = DIV_ROUND_UP(size, granule);
+
+    dirty->granule = granule;
+    dirty->count = 0;
+
+    if(dirty->bitmap == 0) {
+        for(size_t i = find_next_bit(table->dirty, first + bits, first); i < first + bits; i = find_next_bit(table->dirty, first + bits, i + 1)) {
+            dirty->count += 1;
+        }
+        goto out_unlock;
+    }
+
+    for(size_t k = 0; k < bits; k += 64) {
+        unsigned int n = (k / 64) % ARRAY_SIZE(words);
+        u64 word = dmabuf_dirty_take(table->dirty, first + k, min_t(size_t, bits - k, 64));
+
+        words[n] = word;
+        dirty->count += hweight64(word);
+
+        // merge runs of set bits into ranges to write-protect
+        while(word != 0) {
+            unsigned int b = __ffs64(word);
+            u64 rest = ~(word >> b);
+            unsigned int e = rest == 0 ? 64 : b + __ffs64(rest);
+            u64 begin = (first + k + b) << table->dirty_shift, end = (first + k + e) << table->dirty_shift;
+            if(begin != wp_end) {
+                dmabuf_dirty_wrprotect(mapping, mapping_offset + wp_begin, wp_end - wp_begin);
+                wp_begin = begin;
+            }
+            wp_end = end;
+            word = e < 64 ? word & (~0ull << e) : 0;
+        }
+
+        // copy full batch (or the rest) to user space
+        if(n + 1 == ARRAY_SIZE(words) || k + 64 >= bits) {
+            if(copy_to_user(user_bitmap + k / 64 - n, words, (n + 1) * sizeof(words[0])) != 0) {
+                for(unsigned int i = 0; i <= n; i++) {
+                    dmabuf_dirty_restore(table->dirty, first + k - 64 * (n - i), words[i]);
+                }
+                error = -EFAULT;
+                break;
+            }
+            cond_resched();
+        }
+    }
+
+    dmabuf_dirty_wrprotect(mapping, mapping_offset + wp_begin, wp_end - wp_begin);
+
+out_unlock:
+    srcu_read_unlock(&dmabuf->srcu, idx);
+    return error;
+}
+
+/**
+ * Handle DMABUF_IOCTL_DIRTY_GET.
+ *
+ * @retval -ENOTTY - if cmd is not a dirty tracking command
+ */
+static
+long dmabuf_dirty_ioctl(struct dmabuf_banks* banks, struct address_space* mapping, unsigned int cmd, unsigned long arg) {
+    void __user* user_arg = (void __user*)arg;
+    long error;
+
+    switch(cmd) {
+    case DMABUF_IOCTL_DIRTY_GET: {
+        struct dmabuf_dirty dirty;
+        struct dmabuf* dmabuf;
+        u64 offset;
+        if(copy_from_user(&dirty, user_arg, sizeof(dirty)) != 0) return -EFAULT;
+        offset = dirty.offset;
+        dmabuf = dmabuf_banks_get(banks, &dirty.offset);
+        if(dmabuf == NULL) return -EINVAL;
+        error = dmabuf_dirty_get(dmabuf, mapping, offset - dirty.offset, &dirty);
+        dirty.offset = offset;
+        if(error) return error;
+        if(copy_to_user(user_arg, &dirty, sizeof(dirty)) != 0) return -EFAULT;
+        return 0;
+    }
+    }
+
+    return -ENOTTY;
+}
@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+#include "dmabuf.h"
+#include "dmabuf_ops.h"
+#include "dmabuf_ring.h"
+
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/timekeeping.h>
+
+/**
+ * Software emulator of a streaming device (e.g. DAQ board).
+ *
+ * A kthread writes records (struct dmabuf_record) at ring `head`
+ * and publishes the new `head` (as hardware would update a producer index).
+ * Records are written in bursts of `emulator_burst` records,
+ * bursts are paced to the average rate of `emulator_rate` bytes per second.
+ *
+ * If there is no space up to the slowest reader
+ * (and DMABUF_RING_DROP_OLDEST is not set),
+ * the record is not written (counted in `overflows`)
+ * and its sequence number is skipped.
+ */
+struct dmabuf_emulator {
+    struct dmabuf* dmabuf;
+    struct dmabuf_ring* ring;
+    struct task_struct* task;
+    void* record; // record template
+    u32 record_size;
+    u64 sequence;
+    u64 overflows;
+};
+
+static bool dmabuf_emulator_enable = false;
+module_param_named(emulator, dmabuf_emulator_enable, bool, 0444);
+MODULE_PARM_DESC(emulator, "start software device emulator that streams records into the buffer");
+
+static ulong dmabuf_emulator_rate = 100 * 1024 * 1024;
+module_param_named(emulator_rate, dmabuf_emulator_rate, ulong, 0644);
+MODULE_PARM_DESC(emulator_rate, "emulator rate in bytes per second (0 - as fast as possible)");
+
+static uint dmabuf_emulator_record_size = 4096;
+module_param_named(emulator_record, dmabuf_emulator_record_size, uint, 0444);
+MODULE_PARM_DESC(emulator_record, "emulator record size in bytes (multiple of 8)");
+
+static uint dmabuf_emulator_burst = 16;
+module_param_named(emulator_burst, dmabuf_emulator_burst, uint, 0644);
+MODULE_PARM_DESC(emulator_burst, "number of records written back to back before pacing");
+
+/**
+ * Copy `size` bytes to ring position (wrapping at the end of the buffer).
+ *
+ * Written chunks are handed to the device (dmabuf_table_sync_for_device)
+ * before the record is published.
+ *
+ * @retval -ENOMEM - if sparse slot could not be allocated
+ * @retval -EOPNOTSUPP - if the buffer is imported dma-buf (no CPU access)
+ */
+static
+int dmabuf_emulator_copy(struct dmabuf_table* table, u64 position, const void* src, size_t size) {
+    u64 offset;
+
+    if(table->foreign) return -EOPNOTSUPP;
+
+    div64_u64_rem(position, table->size, &offset);
+
+    while(size > 0) {
+        struct dmabuf_chunk chunk = dmabuf_table_chunk(table, offset, size, true);
+        if(chunk.addr == NULL) return -ENOMEM;
+        dmabuf_table_sync_for_cpu(table, offset, chunk.size);
+        memcpy(chunk.addr, src, chunk.size);
+        dmabuf_table_sync_for_device(table, offset, chunk.size);
+        dmabuf_dirty_set(table, offset, chunk.size);
+        src += chunk.size;
+        size -= chunk.size;
+        offset += chunk.size;
+        if(offset == table->size) offset = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Write one record at ring `head` and publish it.
+ *
+ * @retval -ENOSPC - if no space up to the slowest reader
+ * @retval -EAGAIN - if ring and buffer sizes differ (resize in progress)
+ * @retval -ENOMEM - if sparse slot could not be allocated
+ */
+static
+int dmabuf_emulator_record(struct dmabuf_emulator* emulator) {
+    struct dmabuf_record* record = emulator->record;
+    struct dmabuf_ring_reader reader;
+    struct dmabuf_ring_status status;
+    struct dmabuf_table* table;
+    u32* payload = (u32*)(record + 1);
+    int error = 0, idx;
+
+    // the emulator is not a reader, `status.reclaim` is the slowest reader
+    dmabuf_ring_reader_init(&reader);
+    dmabuf_ring_status(emulator->ring, &reader, &status);
+
+    record->sequence = emulator->sequence++;
+    record->timestamp = ktime_get_ns();
+    memset32(payload, (u32)record->sequence, (emulator->record_size - sizeof(*record)) / 4);
+
+    if(status.head + emulator->record_size - status.reclaim > status.size && !(status.flags & DMABUF_RING_DROP_OLDEST)) {
+        return -ENOSPC;
+    }
+
+    idx = srcu_read_lock(&emulator->dmabuf->srcu);
+    table = srcu_dereference(emulator->dmabuf->table, &emulator->dmabuf->srcu);
+    if(table->size != status.size || emulator->record_size > table->size) error = -EAGAIN;
+    else error = dmabuf_emulator_copy(table, status.head, record, emulator->record_size);
+    srcu_read_unlock(&emulator->dmabuf->srcu, idx);
+    if(error) return error;
+
+    return dmabuf_ring_publish(emulator->ring, status.head + emulator->record_size);
+}
+
+static
+int dmabuf_emulator_thread(void* data) {
+    struct dmabuf_emulator* emulator = data;
+    ktime_t expires = ktime_get();
+
+    M_INFO("record_size = %u\n", emulator->record_size);
+
+    while(!kthread_should_stop()) {
+        u32 burst = max_t(u32, READ_ONCE(dmabuf_emulator_burst), 1);
+        u64 rate = READ_ONCE(dmabuf_emulator_rate);
+
+        for(u32 i = 0; i < burst; i++) {
+            int error = dmabuf_emulator_record(emulator);
+            if(error == -ENOSPC) emulator->overflows += 1;
+            else if(error) break;
+        }
+
+        if(rate == 0) {
+            cond_resched();
+            expires = ktime_get();
+            continue;
+        }
+
+        // pace to average rate (catch up after short delays, but not after long stalls)
+        expires = ktime_add_ns(expires, div64_u64((u64)burst * emulator->record_size * NSEC_PER_SEC, rate));
+        if(ktime_before(expires, ktime_sub_ns(ktime_get(), NSEC_PER_SEC))) expires = ktime_get();
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        if(kthread_should_stop()) {
+            __set_current_state(TASK_RUNNING);
+            break;
+        }
+        schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+    }
+
+    M_INFO("sequence = %llu, overflows = %llu\n", emulator->sequence, emulator->overflows);
+
+    return 0;
+}
+
+/**
+ * Start emulator thread (if enabled with `emulator=1` module parameter).
+ *
+ * The emulator is the producer of the ring,
+ * user space should not use DMABUF_IOCTL_RING_PUBLISH at the same time.
+ */
+static
+int dmabuf_emulator_start(struct dmabuf_emulator* emulator, struct dmabuf* dmabuf, struct dmabuf_ring* ring, const char* name) {
+    int error;
+    struct dmabuf_record* record;
+
+    emulator->task = NULL;
+    emulator->record = NULL;
+    if(!dmabuf_emulator_enable) return 0;
+
+    emulator->dmabuf = dmabuf;
+    emulator->ring = ring;
+    emulator->record_size = clamp_t(u32, ALIGN(dmabuf_emulator_record_size, 8), sizeof(*record), dmabuf_entry_size_max());
+    emulator->sequence = 0;
+    emulator->overflows = 0;
+
+    record = kvzalloc(emulator->record_size, GFP_KERNEL);
+    if(record == NULL) {
+        error = -ENOMEM;
+        M_ERR("kvzalloc: error = %d\n", error);
+        goto err_out;
+    }
+    record->magic = DMABUF_RECORD_MAGIC;
+    record->size = emulator->record_size;
+    emulator->record = record;
+
+    emulator->task = kthread_run(dmabuf_emulator_thread, emulator, "%s_emulator", name);
+    if(IS_ERR_OR_NULL(emulator->task)) {
+        if(emulator->task == NULL) error = -ENOMEM;
+        else error = PTR_ERR(emulator->task);
+        emulator->task = NULL;
+        M_ERR("kthread_run: error = %d\n", error);
+        goto err_free;
+    }
+
+    return 0;
+
+err_free:
+    kvfree(emulator->record);
+    emulator->record = NULL;
+err_out:
+    return error;
+}
+
+static
+void dmabuf_emulator_stop(struct dmabuf_emulator* emulator) {
+    if(emulator->task != NULL) kthread_stop(emulator->task);
+    emulator->task = NULL;
+    if(emulator->record != NULL) kvfree(emulator->record);
+    emulator->record = NULL;
+}
@@ -2,17 +2,33 @@
 #pragma once
 
 #include "dmabuf.h"
+#include "dmabuf_bank.h"
+#include "dmabuf_dirty.h"
+#include "dmabuf_ops.h"
+#include "dmabuf_queue.h"
+#include "dmabuf_ring.h"
+#include "dmabuf_sparse.h"
 
 static
 loff_t dmabuf_fops_llseek(struct file* file, loff_t loff, int whence) {
-    struct dmabuf* dmabuf = file->private_data;
-    return dmabuf_llseek(dmabuf, file, loff, whence);
+    struct dmabuf_file* dmabuf_file = file->private_data;
+    // bank of the new position (SEEK_SET) or of the current position
+    loff_t pos = whence == SEEK_SET ? loff : file->f_pos;
+    u64 offset = pos;
+    struct dmabuf* dmabuf = dmabuf_banks_get(&dmabuf_file->dmabuf_device->banks, &offset);
+    if(dmabuf == NULL) return -EINVAL;
+    // `pos - offset` - DMABUF_BANK_OFFSET of the bank
+    return dmabuf_llseek(dmabuf, file, loff, whence, pos - offset);
 }
 
 static
 ssize_t dmabuf_fops_read(struct file* file, char __user* user_buffer, size_t size, loff_t* offset) {
-    struct dmabuf* dmabuf = file->private_data;
-    ssize_t n = dmabuf_read(dmabuf, user_buffer, size, *offset);
+    struct dmabuf_file* dmabuf_file = file->private_data;
+    u64 bank_offset = *offset;
+    struct dmabuf* dmabuf = dmabuf_banks_get(&dmabuf_file->dmabuf_device->banks, &bank_offset);
+    ssize_t n;
+    if(dmabuf == NULL) return 0;
+    n = dmabuf_read(dmabuf, user_buffer, size, bank_offset);
     if(n < 0) return n;
     *offset += n;
     return n;
@@ -20,8 +36,12 @@ ssize_t dmabuf_fops_read(struct file* file, char __user* user_buffer, size_t siz
 
 static
 ssize_t dmabuf_fops_write(struct file* file, const char __user* user_buffer, size_t size, loff_t* offset) {
-    struct dmabuf* dmabuf = file->private_data;
-    ssize_t n = dmabuf_write(dmabuf, user_buffer, size, *offset);
+    struct dmabuf_file* dmabuf_file = file->private_data;
+    u64 bank_offset = *offset;
+    struct dmabuf* dmabuf = dmabuf_banks_get(&dmabuf_file->dmabuf_device->banks, &bank_offset);
+    ssize_t n;
+    if(dmabuf == NULL) return 0;
+    n = dmabuf_write(dmabuf, user_buffer, size, bank_offset);
     if(n < 0) return n;
     *offset += n;
     return n;
@@ -29,14 +49,65 @@ ssize_t dmabuf_fops_write(struct file* file, const char __user* user_buffer, siz
 
 static
 int dmabuf_fops_mmap(struct file* file, struct vm_area_struct* vma) {
-    struct dmabuf* dmabuf = file->private_data;
+    struct dmabuf_file* dmabuf_file = file->private_data;
+    u64 offset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+    struct dmabuf* dmabuf;
+    if(offset == DMABUF_QUEUE_OFFSET) return dmabuf_queue_mmap(&dmabuf_file->queue, vma);
+    dmabuf = dmabuf_banks_get(&dmabuf_file->dmabuf_device->banks, &offset);
+    if(dmabuf == NULL) return -EINVAL;
+    // `vm_pgoff` stays the file offset (zap of bank range, see dmabuf_pgoff_offset)
     return dmabuf_mmap(dmabuf, vma);
 }
 
+static
+__poll_t dmabuf_fops_poll(struct file* file, struct poll_table_struct* wait) {
+    struct dmabuf_file* dmabuf_file = file->private_data;
+    struct dmabuf_ring* ring = &dmabuf_file->dmabuf_device->ring;
+    poll_wait(file, &ring->wait, wait);
+    return dmabuf_ring_poll(ring, &dmabuf_file->reader);
+}
+
+static
+long dmabuf_fops_ioctl(struct file* file, unsigned int cmd, unsigned long arg) {
+    struct dmabuf_file* dmabuf_file = file->private_data;
+    struct dmabuf_device* dmabuf_device = dmabuf_file->dmabuf_device;
+    long error;
+
+    error = dmabuf_device_ioctl(dmabuf_device, file, cmd, arg);
+    if(error != -ENOTTY) return error;
+
+    error = dmabuf_ops_ioctl(dmabuf_device->dmabuf, cmd, arg);
+    if(error != -ENOTTY) return error;
+
+    error = dmabuf_banks_ioctl(&dmabuf_device->banks, cmd, arg);
+    if(error != -ENOTTY) return error;
+
+    error = dmabuf_dirty_ioctl(&dmabuf_device->banks, dmabuf_device->inode->i_mapping, cmd, arg);
+    if(error != -ENOTTY) return error;
+
+    error = dmabuf_sparse_ioctl(&dmabuf_device->banks, dmabuf_device->inode->i_mapping, cmd, arg);
+    if(error != -ENOTTY) return error;
+
+    error = dmabuf_queue_ioctl(&dmabuf_file->queue, dmabuf_device->dmabuf, &dmabuf_device->ring, &dmabuf_file->reader, cmd, arg);
+    if(error != -ENOTTY) return error;
+
+    error = dmabuf_ring_ioctl(&dmabuf_device->ring, &dmabuf_file->reader, cmd, arg);
+    if(error != -ENOTTY) return error;
+
+    M_DEBUG("unknown cmd = 0x%x\n", cmd);
+    return -ENOTTY;
+}
+
 static
 int dmabuf_fops_release(struct inode* inode, struct file* file) {
+    struct dmabuf_file* dmabuf_file = file->private_data;
+
     M_INFO("\n");
 
+    dmabuf_ring_reader_del(&dmabuf_file->dmabuf_device->ring, &dmabuf_file->reader);
+    dmabuf_queue_free(&dmabuf_file->queue);
+    kfree(dmabuf_file);
+
     return 0;
 }
 
@@ -47,6 +118,11 @@ struct file_operations dmabuf_fops = {
     .read = dmabuf_fops_read,
     .write = dmabuf_fops_write,
     .mmap = dmabuf_fops_mmap,
+    .poll = dmabuf_fops_poll,
+    .unlocked_ioctl = dmabuf_fops_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0) // `compat_ptr_ioctl`
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
     .open = dmabuf_fops_open,
     .release = dmabuf_fops_release,
 };
@@ -0,0 +1,313 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+#include "dmabuf.h"
+
+#include <linux/dma-buf.h>
+#include <linux/highmem.h>
+#include <linux/sizes.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0) // `dma_buf_map_attachment_unlocked`
+#define dma_buf_map_attachment_unlocked dma_buf_map_attachment
+#define dma_buf_unmap_attachment_unlocked dma_buf_unmap_attachment
+#endif
+
+/**
+ * Pin user range and build entries from physically contiguous runs.
+ *
+ * Pages are pinned with FOLL_LONGTERM
+ * (the device may access them for an unbounded time),
+ * such that pages of hugetlbfs and THP backed ranges
+ * result in large entries.
+ * The pinned pages are charged to RLIMIT_MEMLOCK of the caller
+ * before anything is allocated
+ * (account_locked_vm, each entry releases its part on unpin).
+ * Pages are pinned in batches of one page of page pointers,
+ * runs are combined across batches.
+ *
+ * @param entries - list to add new entries to (the caller frees it on error)
+ * @param addr - user address (multiple of page size)
+ * @param size - size of range (multiple of page size)
+ *
+ * @retval -EFAULT - if the range can not be pinned
+ * @retval -EINVAL - if pages are in high memory
+ * @retval -ENOMEM - out of memory or RLIMIT_MEMLOCK exceeded
+ */
+static
+int dmabuf_import_pin(struct list_head* entries, unsigned long addr, size_t size) {
+    int error = 0;
+    unsigned long nPages = size >> PAGE_SHIFT, nOwned = 0;
+    unsigned int batch = PAGE_SIZE / sizeof(struct page*);
+    struct dmabuf_entry* entry = NULL;
+    struct page** pages;
+
+    error = account_locked_vm(current->mm, nPages, true);
+    if(error) {
+        M_ERR("account_locked_vm(pages = %lu): error = %d\n", nPages, error);
+        return error;
+    }
+
+    pages = kmalloc_array(batch, sizeof(*pages), GFP_KERNEL);
+    if(pages == NULL) {
+        error = -ENOMEM;
+        M_ERR("kmalloc_array(n = %u): error = %d\n", batch, error);
+        goto out_uncharge;
+    }
+
+    while(nOwned < nPages) {
+        int n = pin_user_pages_fast(addr + (nOwned << PAGE_SHIFT), min_t(unsigned long, nPages - nOwned, batch), FOLL_WRITE | FOLL_LONGTERM, pages);
+        int i = 0;
+        if(n <= 0) {
+            error = n < 0 ? n : -EFAULT;
+            M_ERR("pin_user_pages_fast: error = %d\n", error);
+            break;
+        }
+
+        // combine physically contiguous pages into entries
+        for(; i < n; i++) {
+            if(PageHighMem(pages[i])) {
+                error = -EINVAL;
+                M_ERR("PageHighMem: error = %d\n", error);
+                break;
+            }
+
+            if(entry != NULL && entry->size < SZ_1G && page_to_pfn(pages[i]) == page_to_pfn(entry->page) + (entry->size >> PAGE_SHIFT)) {
+                entry->size += PAGE_SIZE;
+                nOwned++;
+                continue;
+            }
+
+            entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+            if(entry == NULL) {
+                error = -ENOMEM;
+                M_ERR("kzalloc: error = %d\n", error);
+                break;
+            }
+            entry->size = PAGE_SIZE;
+            entry->page = pages[i];
+            entry->cpu_addr = page_address(pages[i]);
+            entry->pinned = true;
+            entry->mm = current->mm;
+            mmgrab(entry->mm);
+            INIT_LIST_HEAD(&entry->list_head);
+            list_add_tail(&entry->list_head, entries);
+            nOwned++;
+        }
+
+        // pages that are not owned by entries
+        for(; i < n; i++) unpin_user_page(pages[i]);
+        if(error) break;
+
+        cond_resched();
+    }
+
+    kfree(pages);
+
+out_uncharge:
+    if(nOwned < nPages) account_locked_vm(current->mm, nPages - nOwned, false);
+    return error;
+}
+
+/**
+ * Import user memory as the buffer.
+ *
+ * The pages are pinned (see dmabuf_import_pin),
+ * mapped with dma_map_sgtable (one IOVA range in IOMMU mode)
+ * and replace the buffer entries (see dmabuf_replace).
+ * The entries are unpinned when the buffer is resized or freed.
+ *
+ * Without IOMMU the pages must be addressable by the device
+ * (the DMA mask is 64-bit), otherwise swiotlb would bounce the data.
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param addr - user address (multiple of page size)
+ * @param size - size of range (multiple of page size)
+ * @param mapping - address space of user mappings (device inode, see dmabuf_fs_inode_new)
+ *
+ * @retval -EINVAL - if size is 0, too large or range is not aligned to page size
+ * @retval - errors from dmabuf_import_pin and dmabuf_replace
+ */
+static
+int dmabuf_import_user(struct dmabuf* dmabuf, u64 addr, u64 size, struct address_space* mapping) {
+    int error;
+    LIST_HEAD(entries);
+
+    if(dmabuf == NULL) return -EFAULT;
+
+    M_INFO("addr = 0x%llx, size = 0x%llx\n", addr, size);
+
+    // memory of the caller (not allocated by the driver)
+    if(dmabuf_size_check(size, false) != 0 || !IS_ALIGNED(addr, PAGE_SIZE)) return -EINVAL;
+    if(addr + size < addr) return -EINVAL;
+
+    error = dmabuf_import_pin(&entries, addr, size);
+    if(error) goto err_free;
+
+    mutex_lock(&dmabuf->lock);
+    error = dmabuf_replace(dmabuf, &entries, size, true, mapping);
+    if(error == 0) dmabuf->imported = true;
+    mutex_unlock(&dmabuf->lock);
+    if(error) goto err_free;
+
+    dmabuf_report(dmabuf);
+
+    return 0;
+
+err_free:
+    dmabuf_entries_free(dmabuf, &entries);
+    return error;
+}
+
+// attachment of imported dma-buf (released with dmabuf->release)
+struct dmabuf_import_dma_buf {
+    struct dma_buf* dma_buf;
+    struct dma_buf_attachment* attachment;
+    struct sg_table* sgt;
+};
+
+static
+void dmabuf_import_dma_buf_release(void* data) {
+    struct dmabuf_import_dma_buf* import = data;
+
+    if(import->sgt != NULL) dma_buf_unmap_attachment_unlocked(import->attachment, import->sgt, DMA_BIDIRECTIONAL);
+    if(import->attachment != NULL) dma_buf_detach(import->dma_buf, import->attachment);
+    dma_buf_put(import->dma_buf);
+    kfree(import);
+}
+
+/**
+ * Build entries from DMA segments of mapped dma-buf.
+ *
+ * The CPU side of the sg_table belongs to the exporter
+ * (pages may be absent or require begin/end_cpu_access),
+ * such that entries only carry DMA addresses
+ * and CPU access (read/write, mmap, ops) is rejected (see dmabuf_table.foreign).
+ *
+ * @retval -EINVAL - if DMA segments are not page aligned
+ * @retval -ENOMEM - out of memory
+ */
+static
+int dmabuf_import_dma_buf_entries(struct list_head* entries, struct sg_table* sgt) {
+    struct scatterlist* sg;
+    int i;
+
+    for_each_sgtable_dma_sg(sgt, sg, i) {
+        struct dmabuf_entry* entry;
+
+        if(sg_dma_len(sg) == 0 || !IS_ALIGNED(sg_dma_address(sg) | sg_dma_len(sg), PAGE_SIZE)) {
+            M_ERR("sg[%d]: DMA segment not page aligned\n", i);
+            return -EINVAL;
+        }
+
+        entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+        if(entry == NULL) {
+            M_ERR("kzalloc: error = %d\n", -ENOMEM);
+            return -ENOMEM;
+        }
+        entry->size = sg_dma_len(sg);
+        entry->dma_handle = sg_dma_address(sg);
+        entry->foreign = true;
+        INIT_LIST_HEAD(&entry->list_head);
+        list_add_tail(&entry->list_head, entries);
+    }
+
+    if(list_empty(entries)) return -EINVAL;
+
+    return 0;
+}
+
+/**
+ * Import dma-buf (e.g. from udmabuf) as the buffer.
+ *
+ * The dma-buf is attached to the device and mapped (dma_buf_map_attachment),
+ * the resulting DMA segments are reported as for the allocated buffer
+ * (see dmabuf_report and DMABUF_IOCTL_SEGMENTS).
+ * The attachment is released when the buffer is resized or freed.
+ * The memory is not accessed by the CPU (read/write, mmap and ops fail with -EOPNOTSUPP).
+ *
+ * \code
+ * dma_buf = dma_buf_get(fd)
+ * sgt = dma_buf_map_attachment(dma_buf_attach(dma_buf, dmabuf->dev))
+ * dmabuf_replace(entries(sgt))
+ * \endcode
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param fd - dma-buf file descriptor
+ * @param mapping - address space of user mappings (device inode, see dmabuf_fs_inode_new)
+ *
+ * @retval -EINVAL - if size is not multiple of page size, too large or DMA segments are not page aligned
+ * @retval - errors from dma_buf_get, dma_buf_attach, dma_buf_map_attachment and dmabuf_replace
+ */
+static
+int dmabuf_import_fd(struct dmabuf* dmabuf, int fd, struct address_space* mapping) {
+    int error;
+    struct dmabuf_import_dma_buf* import;
+    LIST_HEAD(entries);
+
+    if(dmabuf == NULL) return -EFAULT;
+
+    M_INFO("fd = %d\n", fd);
+
+    import = kzalloc(sizeof(*import), GFP_KERNEL);
+    if(import == NULL) {
+        M_ERR("kzalloc: error = %d\n", -ENOMEM);
+        return -ENOMEM;
+    }
+
+    import->dma_buf = dma_buf_get(fd);
+    if(IS_ERR(import->dma_buf)) {
+        error = PTR_ERR(import->dma_buf);
+        M_ERR("dma_buf_get: error = %d\n", error);
+        kfree(import);
+        return error;
+    }
+
+    if(dmabuf_size_check(import->dma_buf->size, false) != 0) {
+        error = -EINVAL;
+        goto err_release;
+    }
+
+    import->attachment = dma_buf_attach(import->dma_buf, dmabuf->dev);
+    if(IS_ERR(import->attachment)) {
+        error = PTR_ERR(import->attachment);
+        import->attachment = NULL;
+        M_ERR("dma_buf_attach: error = %d\n", error);
+        goto err_release;
+    }
+
+    import->sgt = dma_buf_map_attachment_unlocked(import->attachment, DMA_BIDIRECTIONAL);
+    if(IS_ERR(import->sgt)) {
+        error = PTR_ERR(import->sgt);
+        import->sgt = NULL;
+        M_ERR("dma_buf_map_attachment: error = %d\n", error);
+        goto err_release;
+    }
+
+    error = dmabuf_import_dma_buf_entries(&entries, import->sgt);
+    if(error) goto err_release;
+
+    mutex_lock(&dmabuf->lock);
+    error = dmabuf_replace(dmabuf, &entries, import->dma_buf->size, false, mapping);
+    if(error == 0) {
+        dmabuf->imported = true;
+        dmabuf->release = dmabuf_import_dma_buf_release;
+        dmabuf->release_data = import;
+    }
+    mutex_unlock(&dmabuf->lock);
+    if(error) goto err_release;
+
+    dmabuf_report(dmabuf);
+
+    return 0;
+
+err_release:
+    dmabuf_entries_free(dmabuf, &entries);
+    dmabuf_import_dma_buf_release(import);
+    return error;
+}
@@ -0,0 +1,267 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#pragma once
+
+// ioctl interface of `/dev/dmabufN` (shared by driver and user space)
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define DMABUF_IOCTL_MAGIC 'D'
+
+// buffer is mapped through IOMMU (usually one contiguous IOVA range)
+#define DMABUF_INFO_IOMMU (1u << 0)
+// buffer is backed by imported memory (see DMABUF_IOCTL_IMPORT)
+#define DMABUF_INFO_IMPORTED (1u << 1)
+// memory is allocated on first touch (`sparse=1` module parameter), `entries` - committed slots
+#define DMABUF_INFO_SPARSE (1u << 2)
+
+struct dmabuf_info {
+    __u64 size; // buffer size
+    __u64 entries; // number of allocated entries
+    __u64 segments; // number of contiguous DMA segments
+    __u64 fragmentation; // fragmentation score (per mille, 0 - ideal)
+    __u64 flags; // DMABUF_INFO_*
+    __u64 generation; // incremented on each layout change (resize, etc.)
+    __u64 offset; // in - DMABUF_BANK_OFFSET of the bank (0 - bank 0)
+};
+
+// contiguous range of device (DMA) addresses
+struct dmabuf_segment {
+    __u64 offset; // offset in buffer
+    __u64 dma_addr; // device address
+    __u64 size;
+};
+
+struct dmabuf_segments {
+    __u64 count; // in - capacity of `segments` array, out - number of segments
+    __u64 segments; // pointer to array of struct dmabuf_segment
+    __u64 offset; // in - DMABUF_BANK_OFFSET of the bank (0 - bank 0)
+};
+
+#define DMABUF_IOCTL_INFO _IOWR(DMABUF_IOCTL_MAGIC, 0x00, struct dmabuf_info)
+#define DMABUF_IOCTL_SEGMENTS _IOWR(DMABUF_IOCTL_MAGIC, 0x01, struct dmabuf_segments)
+// resize buffer (new size in bytes, multiple of page size, at most DMABUF_BANK_OFFSET(1),
+// above `max_size` module parameter requires CAP_SYS_ADMIN)
+#define DMABUF_IOCTL_RESIZE _IOW(DMABUF_IOCTL_MAGIC, 0x02, __u64)
+
+// drop data not yet consumed by lagging readers instead of failing publish
+#define DMABUF_RING_DROP_OLDEST (1u << 0)
+
+/**
+ * Ring positions are monotonic byte counters,
+ * the corresponding buffer offset is `position % size`.
+ */
+struct dmabuf_ring_status {
+    __u64 size; // ring size (size of the buffer)
+    __u64 head; // producer position
+    __u64 tail; // position of this reader (or `reclaim` if not a reader)
+    __u64 reclaim; // position of the slowest reader (or `head` if no readers)
+    __u64 dropped; // bytes dropped for this reader (DMABUF_RING_DROP_OLDEST)
+    __u32 readers; // number of registered readers
+    __u32 flags; // DMABUF_RING_*
+};
+
+#define DMABUF_IOCTL_RING_STATUS _IOR(DMABUF_IOCTL_MAGIC, 0x10, struct dmabuf_ring_status)
+#define DMABUF_IOCTL_RING_SET_FLAGS _IOW(DMABUF_IOCTL_MAGIC, 0x11, __u32)
+#define DMABUF_IOCTL_RING_PUBLISH _IOW(DMABUF_IOCTL_MAGIC, 0x12, __u64)
+#define DMABUF_IOCTL_READER_REGISTER _IO(DMABUF_IOCTL_MAGIC, 0x13)
+#define DMABUF_IOCTL_READER_UNREGISTER _IO(DMABUF_IOCTL_MAGIC, 0x14)
+#define DMABUF_IOCTL_READER_ADVANCE _IOW(DMABUF_IOCTL_MAGIC, 0x15, __u64)
+
+#define DMABUF_CHECKSUM_CRC32C 0
+#define DMABUF_CHECKSUM_XXH64 1
+
+struct dmabuf_checksum {
+    __u64 offset;
+    __u64 size;
+    __u32 algorithm; // DMABUF_CHECKSUM_*
+    __u32 reserved;
+    __u64 seed; // in - initial value (e.g. checksum of preceding range)
+    __u64 value; // out - checksum
+};
+
+// fill with 32-bit words `value + i * step`
+struct dmabuf_fill {
+    __u64 offset; // multiple of 4
+    __u64 size; // multiple of 4
+    __u32 value;
+    __u32 step; // 0 - pattern, 1 - counter
+};
+
+// copy inside the buffer (ranges may overlap)
+struct dmabuf_copy {
+    __u64 dst;
+    __u64 src;
+    __u64 size;
+};
+
+#define DMABUF_IOCTL_CHECKSUM _IOWR(DMABUF_IOCTL_MAGIC, 0x20, struct dmabuf_checksum)
+#define DMABUF_IOCTL_FILL _IOW(DMABUF_IOCTL_MAGIC, 0x21, struct dmabuf_fill)
+#define DMABUF_IOCTL_COPY _IOW(DMABUF_IOCTL_MAGIC, 0x22, struct dmabuf_copy)
+
+/**
+ * Use user memory (e.g. hugetlbfs or THP backed) as the buffer.
+ *
+ * The pages are pinned and mapped for the device,
+ * the previous buffer memory is released.
+ * DMABUF_IOCTL_RESIZE releases the imported memory
+ * and allocates new buffer memory.
+ */
+struct dmabuf_import {
+    __u64 addr; // user address (multiple of page size)
+    __u64 size; // multiple of page size
+};
+
+#define DMABUF_IOCTL_IMPORT _IOW(DMABUF_IOCTL_MAGIC, 0x30, struct dmabuf_import)
+// use dma-buf (e.g. from `/dev/udmabuf`) as the buffer (dma-buf fd),
+// the memory is not accessed by the CPU (read/write, mmap and ops fail with EOPNOTSUPP)
+#define DMABUF_IOCTL_IMPORT_DMA_BUF _IOW(DMABUF_IOCTL_MAGIC, 0x31, __s32)
+
+/**
+ * Command queue (submission and completion rings) shared with the driver.
+ *
+ * Set up with DMABUF_IOCTL_QUEUE_SETUP (per open file)
+ * and mapped with `mmap(offset = DMABUF_QUEUE_OFFSET, size = setup.size)`.
+ * User space writes commands to `sq[sq_tail % entries]` and increments `sq_tail`,
+ * DMABUF_IOCTL_QUEUE_ENTER processes all submitted commands
+ * (as long as there is space in the completion ring)
+ * and writes completions to `cq[cq_tail % entries]`.
+ * User space consumes completions by incrementing `cq_head`.
+ * Indices are free running (wrap at 2^32), `entries` is a power of 2.
+ */
+#define DMABUF_QUEUE_OFFSET (1ull << 46)
+
+#define DMABUF_OP_NOP 0
+#define DMABUF_OP_CHECKSUM 1 // `checksum`, completion `value` - checksum
+#define DMABUF_OP_FILL 2 // `fill`
+#define DMABUF_OP_COPY 3 // `copy`
+#define DMABUF_OP_RING_PUBLISH 4 // `position`
+#define DMABUF_OP_READER_ADVANCE 5 // `position`
+
+struct dmabuf_queue_sqe {
+    __u32 opcode; // DMABUF_OP_*
+    __u32 reserved;
+    __u64 user_data; // copied to completion
+    union {
+        struct dmabuf_checksum checksum;
+        struct dmabuf_fill fill;
+        struct dmabuf_copy copy;
+        __u64 position;
+    };
+};
+
+struct dmabuf_queue_cqe {
+    __u64 user_data;
+    __s64 result; // 0 or -errno (as for the corresponding ioctl)
+    __u64 value;
+};
+
+// at offset 0 of the queue mapping
+struct dmabuf_queue_header {
+    __u32 sq_head; // written by driver
+    __u32 sq_tail; // written by user space
+    __u32 cq_head; // written by user space
+    __u32 cq_tail; // written by driver
+    __u32 entries;
+    __u32 reserved;
+};
+
+struct dmabuf_queue_setup {
+    __u32 entries; // in - number of entries (rounded up to power of 2)
+    __u32 reserved;
+    __u64 size; // out - size of the queue mapping
+    __u64 sq_offset; // out - offset of struct dmabuf_queue_sqe array
+    __u64 cq_offset; // out - offset of struct dmabuf_queue_cqe array
+};
+
+#define DMABUF_IOCTL_QUEUE_SETUP _IOWR(DMABUF_IOCTL_MAGIC, 0x40, struct dmabuf_queue_setup)
+// process submitted commands (returns number of processed commands)
+#define DMABUF_IOCTL_QUEUE_ENTER _IO(DMABUF_IOCTL_MAGIC, 0x41)
+
+/**
+ * Multi-buffer (ping-pong) mode (`banks=N` module parameter).
+ *
+ * The device holds N equally sized buffers (banks),
+ * bank `i` is mapped (and accessed with pread/pwrite) at offset `DMABUF_BANK_OFFSET(i)`.
+ * The producer fills the active bank (DMABUF_IOCTL_BANK_COMMIT),
+ * DMABUF_IOCTL_BANK_SWAP makes the next bank active
+ * and returns the previous bank and its fill level.
+ * DMABUF_IOCTL_INFO and DMABUF_IOCTL_SEGMENTS select the bank with `offset`,
+ * other commands (ops, ring) refer to bank 0.
+ */
+#define DMABUF_BANK_SHIFT 40
+#define DMABUF_BANK_OFFSET(i) ((__u64)(i) << DMABUF_BANK_SHIFT)
+
+struct dmabuf_bank_info {
+    __u32 count; // number of banks
+    __u32 active; // index of active bank
+    __u64 size; // size of each bank
+    __u64 fill; // fill level of active bank
+    __u64 swaps; // number of swaps
+};
+
+struct dmabuf_bank_swap {
+    __u32 bank; // out - previous bank (ready for consumer)
+    __u32 active; // out - new active bank
+    __u64 fill; // out - fill level of previous bank
+};
+
+#define DMABUF_IOCTL_BANK_INFO _IOR(DMABUF_IOCTL_MAGIC, 0x50, struct dmabuf_bank_info)
+// add bytes to fill level of active bank
+#define DMABUF_IOCTL_BANK_COMMIT _IOW(DMABUF_IOCTL_MAGIC, 0x51, __u64)
+#define DMABUF_IOCTL_BANK_SWAP _IOR(DMABUF_IOCTL_MAGIC, 0x52, struct dmabuf_bank_swap)
+
+/**
+ * Dirty tracking (`dirty=<granule>` module parameter).
+ *
+ * Writes with `write`, through user mappings of the device
+ * and by bulk operations (fill, copy, emulator) mark granules dirty.
+ * DMABUF_IOCTL_DIRTY_GET returns the dirty bits of a range and clears them
+ * (each bit is cleared atomically, such that a write is reported exactly once)
+ * and write-protects the user mappings of the reported granules again.
+ * Writes by the device (DMA) and through other mappings of imported memory
+ * are not tracked.
+ */
+struct dmabuf_dirty {
+    __u64 offset; // in - offset in device file (multiple of granule, may include DMABUF_BANK_OFFSET)
+    __u64 size; // in - size of range (limited to buffer size)
+    __u64 bitmap; // in - pointer to array of __u64 (bit `i` - granule at `offset + i * granule`), 0 - count only (bits are not cleared)
+    __u64 granule; // out - granularity in bytes
+    __u64 count; // out - number of dirty granules
+};
+
+#define DMABUF_IOCTL_DIRTY_GET _IOWR(DMABUF_IOCTL_MAGIC, 0x60, struct dmabuf_dirty)
+
+/**
+ * Sparse mode (`sparse=1` module parameter).
+ *
+ * The buffer size is only reserved, memory is allocated in slots
+ * (of 2 MiB, each slot is a separate DMA segment) on first touch
+ * (page fault, `write`, fill, copy) or with DMABUF_IOCTL_COMMIT.
+ * Not committed slots read as zeros and are not reported by DMABUF_IOCTL_SEGMENTS.
+ * DMABUF_IOCTL_DECOMMIT releases slots that are fully inside the range
+ * (existing mappings are zapped, the memory reads as zeros again).
+ * Import is not supported in this mode.
+ */
+struct dmabuf_range {
+    __u64 offset; // offset in device file (may include DMABUF_BANK_OFFSET)
+    __u64 size;
+};
+
+#define DMABUF_IOCTL_COMMIT _IOW(DMABUF_IOCTL_MAGIC, 0x70, struct dmabuf_range)
+#define DMABUF_IOCTL_DECOMMIT _IOW(DMABUF_IOCTL_MAGIC, 0x71, struct dmabuf_range)
+
+#define DMABUF_RECORD_MAGIC 0x44434552 // "RECD" (little endian)
+
+/**
+ * Header of records written by the emulator (`emulator=1` module parameter).
+ *
+ * Records are written at ring `head` (wrapping at the end of the buffer),
+ * payload is filled with 32-bit words equal to the low 32 bits of `sequence`.
+ */
+struct dmabuf_record {
+    __u32 magic; // DMABUF_RECORD_MAGIC
+    __u32 size; // record size (including header)
+    __u64 sequence; // incremented for each record (including not written ones)
+    __u64 timestamp; // ktime_get_ns
+};
@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+#include "dmabuf.h"
+
+#include <linux/xxhash.h>
+
+#if __has_include(<linux/crc32c.h>)
+#include <linux/crc32c.h>
+#else
+#include <linux/crc32.h>
+#endif
+
+/**
+ * Bulk operations on buffer ranges that run in the kernel
+ * (through `cpu_addr` of entries instead of uncached user mapping).
+ *
+ * All operations are called under dmabuf->srcu
+ * with a table from srcu_dereference
+ * and synchronize only their ranges for the CPU
+ * (see dmabuf_table_sync_for_cpu and dmabuf_table_sync_for_device).
+ * Written ranges are marked dirty (see dmabuf_dirty_set).
+ * Imported dma-buf is not accessed (-EOPNOTSUPP).
+ */
+
+static
+int dmabuf_ops_range_check(struct dmabuf_table* table, u64 offset, u64 size) {
+    if(table->foreign) return -EOPNOTSUPP;
+    if(offset > table->size || size > table->size - offset) return -EINVAL;
+    return 0;
+}
+
+/**
+ * Compute checksum of range.
+ *
+ * CRC32C uses standard convention (initial and final inversion),
+ * such that `seed` can be the checksum of a preceding range.
+ *
+ * @retval -EINVAL - if out of range or unknown algorithm
+ * @retval -EINTR - if interrupted by fatal signal
+ */
+static
+int dmabuf_ops_checksum(struct dmabuf_table* table, struct dmabuf_checksum* checksum) {
+    int error;
+    u64 offset = checksum->offset, size = checksum->size;
+    u32 crc = ~(u32)checksum->seed;
+    struct xxh64_state xxh64;
+
+    error = dmabuf_ops_range_check(table, offset, size);
+    if(error) return error;
+
+    switch(checksum->algorithm) {
+    case DMABUF_CHECKSUM_CRC32C:
+        break;
+    case DMABUF_CHECKSUM_XXH64:
+        xxh64_reset(&xxh64, checksum->seed);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    dmabuf_table_sync_for_cpu(table, checksum->offset, checksum->size);
+    while(size > 0) {
+        struct dmabuf_chunk chunk = dmabuf_table_chunk(table, offset, size, false);
+        if(checksum->algorithm == DMABUF_CHECKSUM_CRC32C) crc = crc32c(crc, chunk.addr, chunk.size);
+        else xxh64_update(&xxh64, chunk.addr, chunk.size);
+        offset += chunk.size;
+        size -= chunk.size;
+        error = dmabuf_yield();
+        if(error) break;
+    }
+    dmabuf_table_sync_for_device(table, checksum->offset, checksum->size);
+    if(error) return error;
+
+    if(checksum->algorithm == DMABUF_CHECKSUM_CRC32C) checksum->value = ~crc;
+    else checksum->value = xxh64_digest(&xxh64);
+
+    return 0;
+}
+
+/**
+ * Fill range with 32-bit words `value + i * step`
+ * (`step = 0` - pattern, `step = 1` - counter).
+ *
+ * @retval -EINVAL - if out of range or not aligned to 4 bytes
+ * @retval -ENOMEM - if sparse slot could not be allocated
+ * @retval -EINTR - if interrupted by fatal signal
+ */
+static
+int dmabuf_ops_fill(struct dmabuf_table* table, struct dmabuf_fill* fill) {
+    int error;
+    u64 offset = fill->offset, size = fill->size;
+    u32 value = fill->value;
+
+    error = dmabuf_ops_range_check(table, offset, size);
+    if(error) return error;
+    if(!IS_ALIGNED(offset, 4) || !IS_ALIGNED(size, 4)) return -EINVAL;
+
+    dmabuf_table_sync_for_cpu(table, fill->offset, fill->size);
+    while(size > 0) {
+        struct dmabuf_chunk chunk = dmabuf_table_chunk(table, offset, size, true);
+        u32* words = chunk.addr;
+        if(words == NULL) {
+            error = -ENOMEM;
+            break;
+        }
+        if(fill->step == 0) {
+            memset32(words, value, chunk.size / 4);
+        }
+        else {
+            for(size_t i = 0; i < chunk.size / 4; i++) {
+                words[i] = value;
+                value += fill->step;
+            }
+        }
+        dmabuf_dirty_set(table, offset, chunk.size);
+        offset += chunk.size;
+        size -= chunk.size;
+        error = dmabuf_yield();
+        if(error) break;
+    }
+    dmabuf_table_sync_for_device(table, fill->offset, fill->size);
+
+    return error;
+}
+
+/**
+ * Copy range inside the buffer (ranges may overlap as in memmove).
+ *
+ * @retval -EINVAL - if out of range
+ * @retval -ENOMEM - if sparse slot could not be allocated
+ * @retval -EINTR - if interrupted by fatal signal
+ */
+static
+int dmabuf_ops_copy(struct dmabuf_table* table, struct dmabuf_copy* copy) {
+    int error;
+    u64 dst = copy->dst, src = copy->src, size = copy->size;
+
+    error = dmabuf_ops_range_check(table, dst, size);
+    if(error) return error;
+    error = dmabuf_ops_range_check(table, src, size);
+    if(error) return error;
+
+    if(dst == src) return 0;
+
+    dmabuf_table_sync_for_cpu(table, copy->src, copy->size);
+    dmabuf_table_sync_for_cpu(table, copy->dst, copy->size);
+    if(dst < src) {
+        // copy forward
+        while(size > 0) {
+            struct dmabuf_chunk d = dmabuf_table_chunk(table, dst, size, true);
+            struct dmabuf_chunk s;
+            if(d.addr == NULL) {
+                error = -ENOMEM;
+                break;
+            }
+            s = dmabuf_table_chunk(table, src, d.size, false);
+            memmove(d.addr, s.addr, s.size);
+            dmabuf_dirty_set(table, dst, s.size);
+            dst += s.size;
+            src += s.size;
+            size -= s.size;
+            error = dmabuf_yield();
+            if(error) break;
+        }
+    }
+    else {
+        // copy backward
+        dst += size;
+        src += size;
+        while(size > 0) {
+            struct dmabuf_chunk d = dmabuf_table_chunk_before(table, dst, size, true);
+            struct dmabuf_chunk s;
+            if(d.addr == NULL) {
+                error = -ENOMEM;
+                break;
+            }
+            s = dmabuf_table_chunk_before(table, src, d.size, false);
+            memmove((char*)d.addr + d.size - s.size, s.addr, s.size);
+            dst -= s.size;
+            dmabuf_dirty_set(table, dst, s.size);
+            src -= s.size;
+            size -= s.size;
+            error = dmabuf_yield();
+            if(error) break;
+        }
+    }
+    dmabuf_table_sync_for_device(table, copy->dst, copy->size);
+    dmabuf_table_sync_for_device(table, copy->src, copy->size);
+
+    return error;
+}
+
+/**
+ * Handle DMABUF_IOCTL_CHECKSUM, DMABUF_IOCTL_FILL and DMABUF_IOCTL_COPY.
+ *
+ * @retval -ENOTTY - if cmd is not a bulk operation
+ */
+static
+long dmabuf_ops_ioctl(struct dmabuf* dmabuf, unsigned int cmd, unsigned long arg) {
+    void __user* user_arg = (void __user*)arg;
+    struct dmabuf_table* table;
+    long error;
+    int idx;
+
+    switch(cmd) {
+    case DMABUF_IOCTL_CHECKSUM: {
+        struct dmabuf_checksum checksum;
+        if(copy_from_user(&checksum, user_arg, sizeof(checksum)) != 0) return -EFAULT;
+        idx = srcu_read_lock(&dmabuf->srcu);
+        table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+        error = dmabuf_ops_checksum(table, &checksum);
+        srcu_read_unlock(&dmabuf->srcu, idx);
+        if(error) return error;
+        if(copy_to_user(user_arg, &checksum, sizeof(checksum)) != 0) return -EFAULT;
+        return 0;
+    }
+    case DMABUF_IOCTL_FILL: {
+        struct dmabuf_fill fill;
+        if(copy_from_user(&fill, user_arg, sizeof(fill)) != 0) return -EFAULT;
+        idx = srcu_read_lock(&dmabuf->srcu);
+        table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+        error = dmabuf_ops_fill(table, &fill);
+        srcu_read_unlock(&dmabuf->srcu, idx);
+        return error;
+    }
+    case DMABUF_IOCTL_COPY: {
+        struct dmabuf_copy copy;
+        if(copy_from_user(&copy, user_arg, sizeof(copy)) != 0) return -EFAULT;
+        idx = srcu_read_lock(&dmabuf->srcu);
+        table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+        error = dmabuf_ops_copy(table, &copy);
+        srcu_read_unlock(&dmabuf->srcu, idx);
+        return error;
+    }
+    }
+
+    return -ENOTTY;
+}
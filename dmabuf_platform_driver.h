@@ -2,27 +2,116 @@
 #pragma once
 
 #include "dmabuf.h"
+#include "dmabuf_bank.h"
+#include "dmabuf_emulator.h"
+#include "dmabuf_import.h"
+#include "dmabuf_queue.h"
+#include "dmabuf_ring.h"
 
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mount.h>
 #include <linux/platform_device.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0) // `init_pseudo`
+#include <linux/pseudo_fs.h>
+#endif
+
+// <https://elixir.bootlin.com/linux/latest/source/drivers/gpu/drm/drm_drv.c> (drm_fs_inode_new)
+#define DMABUF_FS_MAGIC 0x646d6162
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0) // `init_pseudo`
+static
+int dmabuf_fs_init_fs_context(struct fs_context* fc) {
+    return init_pseudo(fc, DMABUF_FS_MAGIC) ? 0 : -ENOMEM;
+}
+#else
+static
+struct dentry* dmabuf_fs_mount(struct file_system_type* fs_type, int flags, const char* dev_name, void* data) {
+    return mount_pseudo(fs_type, "dmabuf:", NULL, NULL, DMABUF_FS_MAGIC);
+}
+#endif
+
+static
+struct file_system_type dmabuf_fs_type = {
+    .owner = THIS_MODULE,
+    .name = "dmabuf",
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0) // `init_pseudo`
+    .init_fs_context = dmabuf_fs_init_fs_context,
+#else
+    .mount = dmabuf_fs_mount,
+#endif
+    .kill_sb = kill_anon_super,
+};
+
+static struct vfsmount* dmabuf_fs_mnt;
+static int dmabuf_fs_count;
+
+/**
+ * Allocate anonymous inode (address space of user mappings of the device).
+ *
+ * All files of the device (also opened through other device nodes,
+ * e.g. mknod in containers) share this address space (see dmabuf_fops_open),
+ * such that unmap_mapping_range reaches all user mappings.
+ *
+ * @return - inode or ERR_PTR
+ */
+static
+struct inode* dmabuf_fs_inode_new(void) {
+    struct inode* inode;
+    int error;
+
+    error = simple_pin_fs(&dmabuf_fs_type, &dmabuf_fs_mnt, &dmabuf_fs_count);
+    if(error != 0) {
+        M_ERR("simple_pin_fs: error = %d\n", error);
+        return ERR_PTR(error);
+    }
+
+    inode = alloc_anon_inode(dmabuf_fs_mnt->mnt_sb);
+    if(IS_ERR(inode)) {
+        M_ERR("alloc_anon_inode: error = %ld\n", PTR_ERR(inode));
+        simple_release_fs(&dmabuf_fs_mnt, &dmabuf_fs_count);
+    }
+
+    return inode;
+}
+
+static
+void dmabuf_fs_inode_free(struct inode* inode) {
+    if(IS_ERR_OR_NULL(inode)) return;
+    iput(inode);
+    simple_release_fs(&dmabuf_fs_mnt, &dmabuf_fs_count);
+}
 
 struct dmabuf_device {
     int id;
     char* name;
-    struct dmabuf* dmabuf;
+    struct dmabuf* dmabuf; // bank 0
+    struct dmabuf_banks banks;
+    struct dmabuf_ring ring;
+    struct dmabuf_emulator emulator;
+    struct inode* inode; // address space of user mappings
     struct miscdevice miscdevice;
 };
 
+// per open file state
+struct dmabuf_file {
+    struct dmabuf_device* dmabuf_device;
+    struct dmabuf_ring_reader reader;
+    struct dmabuf_queue queue;
+};
+
 static DEFINE_IDA(dmabuf_ida);
 
 static
 void dmabuf_device_free(struct dmabuf_device* dmabuf_device) {
     if(IS_ERR_OR_NULL(dmabuf_device)) return;
 
+    dmabuf_emulator_stop(&dmabuf_device->emulator);
     if(dmabuf_device->miscdevice.minor != MISC_DYNAMIC_MINOR) misc_deregister(&dmabuf_device->miscdevice);
 
+    dmabuf_banks_free(&dmabuf_device->banks);
     dmabuf_free(dmabuf_device->dmabuf);
+    dmabuf_fs_inode_free(dmabuf_device->inode);
     if(dmabuf_device->name != NULL) kfree(dmabuf_device->name);
     if(dmabuf_device->id >= 0) ida_free(&dmabuf_ida, dmabuf_device->id);
     kfree(dmabuf_device);
@@ -31,13 +120,16 @@ void dmabuf_device_free(struct dmabuf_device* dmabuf_device) {
 /**
  * \code
  * dmabuf_device = container_of(file->private_data)
- * file->private_data = dmabuf_device->dmabuf
+ * file->private_data = dmabuf_file = kzalloc()
+ * dmabuf_file->dmabuf_device = dmabuf_device
+ * file->f_mapping = dmabuf_device->inode->i_mapping
  * \endcode
  */
 static
 int dmabuf_fops_open(struct inode* inode, struct file* file) {
     struct dmabuf_device* dmabuf_device;
     struct dmabuf* dmabuf;
+    struct dmabuf_file* dmabuf_file;
 
     M_INFO("\n");
 
@@ -53,11 +145,71 @@ int dmabuf_fops_open(struct inode* inode, struct file* file) {
         return -ENODEV;
     }
 
-    file->private_data = dmabuf;
+    dmabuf_file = kzalloc(sizeof(*dmabuf_file), GFP_KERNEL);
+    if(dmabuf_file == NULL) {
+        M_ERR("kzalloc: error = %d\n", -ENOMEM);
+        return -ENOMEM;
+    }
+    dmabuf_file->dmabuf_device = dmabuf_device;
+    dmabuf_ring_reader_init(&dmabuf_file->reader);
+    dmabuf_queue_init(&dmabuf_file->queue);
+
+    file->private_data = dmabuf_file;
+    // mmap and zap through the device address space
+    file->f_mapping = dmabuf_device->inode->i_mapping;
 
     return 0;
 }
 
+/**
+ * Handle device commands (DMABUF_IOCTL_RESIZE, DMABUF_IOCTL_IMPORT*).
+ *
+ * The ring is held in resize state for the whole operation
+ * (see dmabuf_ring_resize_begin), such that concurrent resizes
+ * and reader registration are refused with -EBUSY.
+ *
+ * @retval -ENOTTY - if cmd is not a device command
+ */
+static
+long dmabuf_device_ioctl(struct dmabuf_device* dmabuf_device, struct file* file, unsigned int cmd, unsigned long arg) {
+    void __user* user_arg = (void __user*)arg;
+    struct dmabuf* dmabuf = dmabuf_device->dmabuf;
+    long error;
+
+    if(cmd != DMABUF_IOCTL_RESIZE && cmd != DMABUF_IOCTL_IMPORT && cmd != DMABUF_IOCTL_IMPORT_DMA_BUF) return -ENOTTY;
+
+    // banks must stay equally sized
+    if(dmabuf_device->banks.count > 1) return -EBUSY;
+
+    // ring positions are only valid for fixed size
+    error = dmabuf_ring_resize_begin(&dmabuf_device->ring);
+    if(error) return error;
+
+    switch(cmd) {
+    case DMABUF_IOCTL_RESIZE: {
+        u64 size;
+        if(get_user(size, (u64 __user*)user_arg) != 0) error = -EFAULT;
+        else error = dmabuf_resize(dmabuf, size, dmabuf_device->inode->i_mapping);
+        break;
+    }
+    case DMABUF_IOCTL_IMPORT: {
+        struct dmabuf_import import;
+        if(copy_from_user(&import, user_arg, sizeof(import)) != 0) error = -EFAULT;
+        else error = dmabuf_import_user(dmabuf, import.addr, import.size, dmabuf_device->inode->i_mapping);
+        break;
+    }
+    case DMABUF_IOCTL_IMPORT_DMA_BUF: {
+        s32 fd;
+        if(get_user(fd, (s32 __user*)user_arg) != 0) error = -EFAULT;
+        else error = dmabuf_import_fd(dmabuf, fd, dmabuf_device->inode->i_mapping);
+        break;
+    }
+    }
+
+    dmabuf_ring_resize_end(&dmabuf_device->ring, error, READ_ONCE(dmabuf->size));
+    return error;
+}
+
 #include "dmabuf_fops.h"
 
 static
@@ -73,6 +225,9 @@ int dmabuf_platform_driver_probe(struct platform_device* pdev) {
         goto err_out;
     }
 
+    // allow IOMMU to merge all entries into one DMA segment
+    if(pdev->dev.dma_parms != NULL) dma_set_max_seg_size(&pdev->dev, UINT_MAX);
+
     dmabuf_device = kzalloc(sizeof(*dmabuf_device), GFP_KERNEL);
     if(IS_ERR_OR_NULL(dmabuf_device)) {
         if(dmabuf_device == NULL) error = -ENOMEM;
@@ -83,6 +238,13 @@ int dmabuf_platform_driver_probe(struct platform_device* pdev) {
     }
     dmabuf_device->miscdevice.minor = MISC_DYNAMIC_MINOR; // mark not registered
 
+    dmabuf_device->inode = dmabuf_fs_inode_new();
+    if(IS_ERR(dmabuf_device->inode)) {
+        error = PTR_ERR(dmabuf_device->inode);
+        dmabuf_device->inode = NULL;
+        goto err_out;
+    }
+
     dmabuf_device->id = ida_alloc(&dmabuf_ida, GFP_KERNEL);
     if(dmabuf_device->id < 0) {
         error = dmabuf_device->id;
@@ -99,7 +261,14 @@ int dmabuf_platform_driver_probe(struct platform_device* pdev) {
         goto err_out;
     }
 
-    dmabuf_device->dmabuf = dmabuf_alloc(&pdev->dev, 1024 * 1024 * 1024);
+    if(dmabuf_banks_count == 0 || dmabuf_banks_count > DMABUF_BANKS_MAX) {
+        error = -EINVAL;
+        M_ERR("banks = %u: error = %d\n", dmabuf_banks_count, error);
+        goto err_out;
+    }
+
+    // split 1 GiB between banks
+    dmabuf_device->dmabuf = dmabuf_alloc(&pdev->dev, PAGE_ALIGN(1024 * 1024 * 1024 / dmabuf_banks_count));
     if(IS_ERR_OR_NULL(dmabuf_device->dmabuf)) {
         if(dmabuf_device->dmabuf == NULL) error = -ENOMEM;
         else error = PTR_ERR(dmabuf_device->dmabuf);
@@ -108,6 +277,22 @@ int dmabuf_platform_driver_probe(struct platform_device* pdev) {
         goto err_out;
     }
 
+    dmabuf_banks_init(&dmabuf_device->banks);
+    dmabuf_device->banks.dmabuf[0] = dmabuf_device->dmabuf;
+    error = dmabuf_banks_alloc(&dmabuf_device->banks, &pdev->dev, dmabuf_banks_count);
+    if(error != 0) {
+        M_ERR("dmabuf_banks_alloc(): error = %d\n", error);
+        goto err_out;
+    }
+
+    dmabuf_ring_init(&dmabuf_device->ring, dmabuf_device->dmabuf->size);
+
+    error = dmabuf_emulator_start(&dmabuf_device->emulator, dmabuf_device->dmabuf, &dmabuf_device->ring, dmabuf_device->name);
+    if(error != 0) {
+        M_ERR("dmabuf_emulator_start(): error = %d\n", error);
+        goto err_out;
+    }
+
     dmabuf_device->miscdevice.name = dmabuf_device->name;
     dmabuf_device->miscdevice.fops = &dmabuf_fops;
     dmabuf_device->miscdevice.parent = &pdev->dev;
@@ -0,0 +1,171 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include "dmabuf_pmr.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <new>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static
+std::system_error errno_error(const char* what) {
+    return std::system_error(errno, std::generic_category(), what);
+}
+
+dmabuf_map_t::dmabuf_map_t(const char* file, size_t size, size_t offset)
+    : size(size), offset(offset & (DMABUF_BANK_OFFSET(1) - 1)), bank(offset & ~(DMABUF_BANK_OFFSET(1) - 1)) {
+    fd = ::open(file, O_RDWR | O_CLOEXEC);
+    if(fd < 0) throw errno_error("open");
+
+    if(this->size == 0) {
+        dmabuf_info info {};
+        info.offset = bank;
+        if(::ioctl(fd, DMABUF_IOCTL_INFO, &info) < 0) {
+            auto error = errno_error("ioctl(DMABUF_IOCTL_INFO)");
+            close(fd);
+            throw error;
+        }
+        if(this->offset >= info.size) {
+            close(fd);
+            throw std::system_error(EINVAL, std::generic_category(), "dmabuf_map_t: offset is outside of the bank");
+        }
+        this->size = info.size - this->offset;
+    }
+
+    addr = ::mmap(nullptr, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if(addr == MAP_FAILED) {
+        auto error = errno_error("mmap");
+        close(fd);
+        throw error;
+    }
+
+    try {
+        update_segments();
+    }
+    catch(...) {
+        munmap(addr, this->size);
+        close(fd);
+        throw;
+    }
+}
+
+dmabuf_map_t::~dmabuf_map_t() {
+    munmap(addr, size);
+    close(fd);
+}
+
+void dmabuf_map_t::update_segments() {
+    dmabuf_segments request {};
+    request.offset = bank;
+    // query count, then fill (retry if layout changed in between)
+    do {
+        request.count = segments.size();
+        request.segments = reinterpret_cast<uintptr_t>(segments.data());
+        if(::ioctl(fd, DMABUF_IOCTL_SEGMENTS, &request) < 0) throw errno_error("ioctl(DMABUF_IOCTL_SEGMENTS)");
+        if(request.count <= segments.size()) break;
+        segments.resize(request.count);
+    } while(true);
+    segments.resize(request.count);
+}
+
+const dmabuf_segment* dmabuf_map_t::find(const void* p) const {
+    if(!contains(p)) return nullptr;
+    uint64_t buffer_offset = offset + (static_cast<const char*>(p) - static_cast<const char*>(addr));
+    // first segment that starts after offset
+    auto it = std::upper_bound(segments.begin(), segments.end(), buffer_offset, [] (uint64_t x, const dmabuf_segment& segment) {
+        return x < segment.offset;
+    });
+    if(it == segments.begin()) return nullptr;
+    --it;
+    if(buffer_offset - it->offset >= it->size) return nullptr;
+    return &*it;
+}
+
+uint64_t dmabuf_map_t::dma_addr(const void* p) const {
+    auto segment = find(p);
+    if(segment == nullptr) return 0;
+    uint64_t buffer_offset = offset + (static_cast<const char*>(p) - static_cast<const char*>(addr));
+    return segment->dma_addr + (buffer_offset - segment->offset);
+}
+
+size_t dmabuf_map_t::dma_size(const void* p) const {
+    auto segment = find(p);
+    if(segment == nullptr) return 0;
+    uint64_t buffer_offset = offset + (static_cast<const char*>(p) - static_cast<const char*>(addr));
+    // do not extend past the mapping
+    size_t end = std::min<uint64_t>(segment->offset + segment->size, offset + size);
+    return end - buffer_offset;
+}
+
+dmabuf_arena_resource_t::dmabuf_arena_resource_t(dmabuf_map_t& map, size_t offset, size_t size) : map_(map) {
+    if(offset > map.size || size > map.size - offset) throw std::out_of_range("dmabuf_arena_resource_t: range is outside of the mapping");
+    begin = static_cast<char*>(map.addr) + offset;
+    end = begin + size;
+    current = begin;
+}
+
+size_t dmabuf_arena_resource_t::used() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return current - begin;
+}
+
+void dmabuf_arena_resource_t::release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    current = begin;
+}
+
+void* dmabuf_arena_resource_t::do_allocate(size_t bytes, size_t alignment) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uintptr_t p = (reinterpret_cast<uintptr_t>(current) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+    if(p > reinterpret_cast<uintptr_t>(end) || bytes > reinterpret_cast<uintptr_t>(end) - p) throw std::bad_alloc();
+    current = reinterpret_cast<char*>(p + bytes);
+    return reinterpret_cast<void*>(p);
+}
+
+dmabuf_pool_resource_t::dmabuf_pool_resource_t(dmabuf_arena_resource_t& arena, size_t max_block, size_t chunk)
+    : arena(arena), max_block(max_block), chunk(std::max(chunk, max_block)) {
+    free_lists.resize(size_class(max_block, 1) + 1, nullptr);
+}
+
+// log2 of block size (at least pointer size, power of 2 blocks are aligned to their size)
+size_t dmabuf_pool_resource_t::size_class(size_t bytes, size_t alignment) {
+    size_t size = std::max({ bytes, alignment, sizeof(block_t) });
+    size_t k = 0;
+    while((size_t(1) << k) < size) k++;
+    return k;
+}
+
+void* dmabuf_pool_resource_t::do_allocate(size_t bytes, size_t alignment) {
+    size_t k = size_class(bytes, alignment);
+    if(k >= free_lists.size()) return arena.allocate(bytes, alignment);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if(free_lists[k] == nullptr) {
+        // carve new chunk into blocks of size 2^k
+        size_t block = size_t(1) << k;
+        auto p = static_cast<char*>(arena.allocate(chunk, block));
+        for(size_t i = chunk / block; i-- > 0;) {
+            auto b = reinterpret_cast<block_t*>(p + i * block);
+            b->next = free_lists[k];
+            free_lists[k] = b;
+        }
+    }
+    block_t* b = free_lists[k];
+    free_lists[k] = b->next;
+    return b;
+}
+
+void dmabuf_pool_resource_t::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    size_t k = size_class(bytes, alignment);
+    if(k >= free_lists.size()) return; // owned by arena
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto b = static_cast<block_t*>(p);
+    b->next = free_lists[k];
+    free_lists[k] = b;
+}
@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+// `std::pmr::memory_resource` over mmap of `/dev/dmabufN`
+
+#include "dmabuf_ioctl.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+/**
+ * Shared mapping of the DMA buffer and its DMA segments.
+ *
+ * Throws std::system_error if open, mmap or ioctl fails.
+ */
+struct dmabuf_map_t {
+    int fd = -1;
+    void* addr = nullptr;
+    size_t size = 0;
+    std::vector<dmabuf_segment> segments;
+
+    // map `size` bytes (0 - up to the end of the bank) at `offset` (may include DMABUF_BANK_OFFSET)
+    explicit dmabuf_map_t(const char* file = "/dev/dmabuf0", size_t size = 0, size_t offset = 0);
+    ~dmabuf_map_t();
+
+    dmabuf_map_t(const dmabuf_map_t&) = delete;
+    dmabuf_map_t& operator=(const dmabuf_map_t&) = delete;
+
+    // reload DMA segments (e.g. after resize or import)
+    void update_segments();
+
+    bool contains(const void* p) const {
+        return addr <= p && p < static_cast<const char*>(addr) + size;
+    }
+
+    /**
+     * Translate pointer into the mapping to device (DMA) address.
+     *
+     * Contiguous range of device addresses starting at `p`
+     * extends to the end of the segment (see `dma_size`).
+     *
+     * @return - device address or 0 if `p` is not in the mapping
+     */
+    uint64_t dma_addr(const void* p) const;
+
+    // contiguous size in device address space from `p`
+    size_t dma_size(const void* p) const;
+
+private:
+    size_t offset = 0; // offset of the mapping in the bank
+    uint64_t bank = 0; // DMABUF_BANK_OFFSET of the bank (DMABUF_IOCTL_INFO and DMABUF_IOCTL_SEGMENTS)
+    const dmabuf_segment* find(const void* p) const;
+};
+
+/**
+ * Bump allocator (arena) over a range of the mapping.
+ *
+ * Deallocation is a no-op, memory is reused after `release()`.
+ * Thread safe.
+ */
+struct dmabuf_arena_resource_t : std::pmr::memory_resource {
+    explicit dmabuf_arena_resource_t(dmabuf_map_t& map) : dmabuf_arena_resource_t(map, 0, map.size) {}
+    dmabuf_arena_resource_t(dmabuf_map_t& map, size_t offset, size_t size);
+
+    dmabuf_map_t& map() const { return map_; }
+    size_t used() const;
+    // forget all allocations
+    void release();
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+    dmabuf_map_t& map_;
+    char* begin;
+    char* end;
+    char* current;
+    mutable std::mutex mutex;
+};
+
+/**
+ * Pool allocator with power of 2 size classes (up to `max_block` bytes).
+ *
+ * Blocks are carved in chunks from the upstream arena
+ * and returned to per size class free lists on deallocation.
+ * Larger allocations go to the arena directly (not reused).
+ * Thread safe.
+ */
+struct dmabuf_pool_resource_t : std::pmr::memory_resource {
+    explicit dmabuf_pool_resource_t(dmabuf_arena_resource_t& arena, size_t max_block = 64 * 1024, size_t chunk = 1024 * 1024);
+
+    dmabuf_map_t& map() const { return arena.map(); }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+    struct block_t { block_t* next; };
+
+    dmabuf_arena_resource_t& arena;
+    size_t max_block;
+    size_t chunk;
+    std::vector<block_t*> free_lists; // index - log2(block size)
+    std::mutex mutex;
+
+    static size_t size_class(size_t bytes, size_t alignment);
+};
@@ -0,0 +1,232 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+#include "dmabuf.h"
+#include "dmabuf_ops.h"
+#include "dmabuf_ring.h"
+
+#include <linux/vmalloc.h>
+
+/**
+ * Command queue shared with user space (see DMABUF_IOCTL_QUEUE_SETUP).
+ *
+ * Submission and completion rings live in one vmalloc_user area
+ * that is mapped at DMABUF_QUEUE_OFFSET,
+ * such that a batch of commands costs one DMABUF_IOCTL_QUEUE_ENTER.
+ */
+struct dmabuf_queue {
+    struct mutex lock; // serialize setup and enter
+    void* mem;
+    size_t size;
+    u32 entries;
+    struct dmabuf_queue_header* header;
+    struct dmabuf_queue_sqe* sq;
+    struct dmabuf_queue_cqe* cq;
+};
+
+#define DMABUF_QUEUE_ENTRIES_MAX 4096
+
+static
+void dmabuf_queue_init(struct dmabuf_queue* queue) {
+    mutex_init(&queue->lock);
+    queue->mem = NULL;
+}
+
+static
+void dmabuf_queue_free(struct dmabuf_queue* queue) {
+    if(queue->mem != NULL) vfree(queue->mem);
+    queue->mem = NULL;
+    mutex_destroy(&queue->lock);
+}
+
+/**
+ * Allocate queue memory.
+ *
+ * @retval -EBUSY - if already set up
+ * @retval -EINVAL - if entries is 0 or too large
+ * @retval -ENOMEM - out of memory
+ */
+static
+int dmabuf_queue_setup(struct dmabuf_queue* queue, struct dmabuf_queue_setup* setup) {
+    int error = 0;
+    u32 entries;
+    size_t sq_offset, cq_offset, size;
+
+    if(setup->entries == 0 || setup->entries > DMABUF_QUEUE_ENTRIES_MAX) return -EINVAL;
+    entries = roundup_pow_of_two(setup->entries);
+
+    sq_offset = ALIGN(sizeof(struct dmabuf_queue_header), SMP_CACHE_BYTES);
+    cq_offset = ALIGN(sq_offset + entries * sizeof(struct dmabuf_queue_sqe), SMP_CACHE_BYTES);
+    size = PAGE_ALIGN(cq_offset + entries * sizeof(struct dmabuf_queue_cqe));
+
+    mutex_lock(&queue->lock);
+    if(queue->mem != NULL) {
+        error = -EBUSY;
+        goto out_unlock;
+    }
+
+    queue->mem = vmalloc_user(size); // zeroed
+    if(queue->mem == NULL) {
+        error = -ENOMEM;
+        M_ERR("vmalloc_user(size = 0x%zx): error = %d\n", size, error);
+        goto out_unlock;
+    }
+    queue->size = size;
+    queue->entries = entries;
+    queue->header = queue->mem;
+    queue->header->entries = entries;
+    queue->sq = queue->mem + sq_offset;
+    queue->cq = queue->mem + cq_offset;
+
+    setup->entries = entries;
+    setup->size = size;
+    setup->sq_offset = sq_offset;
+    setup->cq_offset = cq_offset;
+
+out_unlock:
+    mutex_unlock(&queue->lock);
+    return error;
+}
+
+/**
+ * Map queue memory (mmap at DMABUF_QUEUE_OFFSET).
+ *
+ * @retval -ENODEV - if not set up
+ * @retval -EINVAL - if larger than queue memory
+ */
+static
+int dmabuf_queue_mmap(struct dmabuf_queue* queue, struct vm_area_struct* vma) {
+    int error;
+
+    mutex_lock(&queue->lock);
+    if(queue->mem == NULL) error = -ENODEV;
+    else if(vma->vm_end - vma->vm_start > queue->size) error = -EINVAL;
+    else error = remap_vmalloc_range(vma, queue->mem, 0);
+    mutex_unlock(&queue->lock);
+
+    return error;
+}
+
+/**
+ * Execute one command (same semantics as the corresponding ioctl).
+ *
+ * @param table - buffer table (under dmabuf->srcu)
+ */
+static
+long dmabuf_queue_exec(struct dmabuf_table* table, struct dmabuf_ring* ring, struct dmabuf_ring_reader* reader, struct dmabuf_queue_sqe* sqe, u64* value) {
+    switch(sqe->opcode) {
+    case DMABUF_OP_NOP:
+        return 0;
+    case DMABUF_OP_CHECKSUM: {
+        long error = dmabuf_ops_checksum(table, &sqe->checksum);
+        if(error == 0) *value = sqe->checksum.value;
+        return error;
+    }
+    case DMABUF_OP_FILL:
+        return dmabuf_ops_fill(table, &sqe->fill);
+    case DMABUF_OP_COPY:
+        return dmabuf_ops_copy(table, &sqe->copy);
+    case DMABUF_OP_RING_PUBLISH:
+        return dmabuf_ring_publish(ring, sqe->position);
+    case DMABUF_OP_READER_ADVANCE:
+        return dmabuf_ring_reader_advance(ring, reader, sqe->position);
+    }
+
+    return -EINVAL;
+}
+
+/**
+ * Process submitted commands.
+ *
+ * \code
+ * for(sq_head != sq_tail && cq_tail - cq_head < entries) {
+ *     cq[cq_tail++] = exec(sq[sq_head++])
+ * }
+ * \endcode
+ *
+ * The buffer table is taken once for the whole batch
+ * (each command synchronizes only its range, see dmabuf_ops_checksum).
+ * Commands are copied from the shared memory before execution
+ * (user space can modify the entries at any time).
+ *
+ * @return - number of processed commands
+ *
+ * @retval -ENODEV - if not set up
+ * @retval -EINTR - if interrupted by fatal signal before any command was processed
+ */
+static
+long dmabuf_queue_enter(struct dmabuf_queue* queue, struct dmabuf* dmabuf, struct dmabuf_ring* ring, struct dmabuf_ring_reader* reader) {
+    struct dmabuf_queue_header* header;
+    struct dmabuf_table* table;
+    u32 sq_head, sq_tail, cq_tail, mask;
+    long n = 0;
+    int idx;
+
+    mutex_lock(&queue->lock);
+    if(queue->mem == NULL) {
+        mutex_unlock(&queue->lock);
+        return -ENODEV;
+    }
+    header = queue->header;
+    mask = queue->entries - 1;
+
+    // driver owns sq_head and cq_tail
+    sq_head = READ_ONCE(header->sq_head);
+    cq_tail = READ_ONCE(header->cq_tail);
+    sq_tail = smp_load_acquire(&header->sq_tail);
+
+    idx = srcu_read_lock(&dmabuf->srcu);
+    table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+
+    while(sq_head != sq_tail && cq_tail - smp_load_acquire(&header->cq_head) < queue->entries) {
+        struct dmabuf_queue_sqe sqe;
+        struct dmabuf_queue_cqe cqe = { 0 };
+
+        memcpy(&sqe, &queue->sq[sq_head & mask], sizeof(sqe));
+        sq_head += 1;
+
+        cqe.user_data = sqe.user_data;
+        cqe.result = dmabuf_queue_exec(table, ring, reader, &sqe, &cqe.value);
+        queue->cq[cq_tail & mask] = cqe;
+        cq_tail += 1;
+        n += 1;
+
+        // publish each completion (user space may poll the completion ring)
+        smp_store_release(&header->sq_head, sq_head);
+        smp_store_release(&header->cq_tail, cq_tail);
+
+        if(fatal_signal_pending(current)) break;
+    }
+
+    srcu_read_unlock(&dmabuf->srcu, idx);
+    mutex_unlock(&queue->lock);
+
+    if(n == 0 && fatal_signal_pending(current)) return -EINTR;
+    return n;
+}
+
+/**
+ * Handle DMABUF_IOCTL_QUEUE_SETUP and DMABUF_IOCTL_QUEUE_ENTER.
+ *
+ * @retval -ENOTTY - if cmd is not a queue command
+ */
+static
+long dmabuf_queue_ioctl(struct dmabuf_queue* queue, struct dmabuf* dmabuf, struct dmabuf_ring* ring, struct dmabuf_ring_reader* reader, unsigned int cmd, unsigned long arg) {
+    void __user* user_arg = (void __user*)arg;
+    long error;
+
+    switch(cmd) {
+    case DMABUF_IOCTL_QUEUE_SETUP: {
+        struct dmabuf_queue_setup setup;
+        if(copy_from_user(&setup, user_arg, sizeof(setup)) != 0) return -EFAULT;
+        error = dmabuf_queue_setup(queue, &setup);
+        if(error) return error;
+        if(copy_to_user(user_arg, &setup, sizeof(setup)) != 0) return -EFAULT;
+        return 0;
+    }
+    case DMABUF_IOCTL_QUEUE_ENTER:
+        return dmabuf_queue_enter(queue, dmabuf, ring, reader);
+    }
+
+    return -ENOTTY;
+}
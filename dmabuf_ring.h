@@ -0,0 +1,318 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+#include "module.h"
+#include "dmabuf_ioctl.h"
+
+#include <linux/list.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0) // `__poll_t`
+typedef unsigned int __poll_t;
+#define EPOLLIN POLLIN
+#define EPOLLRDNORM POLLRDNORM
+#define EPOLLOUT POLLOUT
+#define EPOLLWRNORM POLLWRNORM
+#endif
+
+struct dmabuf_ring_reader {
+    u64 tail;
+    u64 dropped;
+    struct list_head list_head; // empty if not registered
+};
+
+/**
+ * Broadcast ring with one producer and many readers.
+ *
+ * The producer publishes `head`,
+ * each reader consumes at its own pace by advancing its `tail`.
+ * Space up to the slowest reader (`reclaim`) can be reused by the producer.
+ */
+struct dmabuf_ring {
+    spinlock_t lock;
+    u64 size;
+    u64 head;
+    u32 flags;
+    u32 nReaders;
+    bool resizing; // buffer resize in progress (see dmabuf_ring_resize_begin)
+    struct list_head readers;
+    wait_queue_head_t wait;
+};
+
+static
+void dmabuf_ring_init(struct dmabuf_ring* ring, u64 size) {
+    spin_lock_init(&ring->lock);
+    ring->size = size;
+    ring->head = 0;
+    ring->flags = 0;
+    ring->nReaders = 0;
+    ring->resizing = false;
+    INIT_LIST_HEAD(&ring->readers);
+    init_waitqueue_head(&ring->wait);
+}
+
+static
+void dmabuf_ring_reader_init(struct dmabuf_ring_reader* reader) {
+    reader->tail = 0;
+    reader->dropped = 0;
+    INIT_LIST_HEAD(&reader->list_head);
+}
+
+// the caller must hold ring->lock
+static
+u64 dmabuf_ring_reclaim_locked(struct dmabuf_ring* ring) {
+    u64 reclaim = ring->head;
+    struct dmabuf_ring_reader* reader;
+
+    list_for_each_entry(reader, &ring->readers, list_head) {
+        if(reader->tail < reclaim) reclaim = reader->tail;
+    }
+
+    return reclaim;
+}
+
+/**
+ * Register reader, reader starts at current `head`.
+ *
+ * @retval -EBUSY - if already registered or buffer resize is in progress
+ */
+static
+int dmabuf_ring_reader_add(struct dmabuf_ring* ring, struct dmabuf_ring_reader* reader) {
+    int error = 0;
+
+    spin_lock(&ring->lock);
+    if(!list_empty(&reader->list_head) || ring->resizing) {
+        error = -EBUSY;
+    }
+    else {
+        reader->tail = ring->head;
+        reader->dropped = 0;
+        list_add_tail(&reader->list_head, &ring->readers);
+        ring->nReaders += 1;
+    }
+    spin_unlock(&ring->lock);
+
+    return error;
+}
+
+static
+void dmabuf_ring_reader_del(struct dmabuf_ring* ring, struct dmabuf_ring_reader* reader) {
+    spin_lock(&ring->lock);
+    if(!list_empty(&reader->list_head)) {
+        list_del_init(&reader->list_head);
+        ring->nReaders -= 1;
+    }
+    spin_unlock(&ring->lock);
+
+    // slowest reader may be gone
+    wake_up_interruptible_all(&ring->wait);
+}
+
+/**
+ * Start buffer resize (ring positions are only valid for fixed size).
+ *
+ * Readers can not register until dmabuf_ring_resize_end,
+ * such that no reader attaches to a ring of changing size.
+ *
+ * \code
+ * dmabuf_ring_resize_begin(ring)
+ * error = resize(buffer)
+ * dmabuf_ring_resize_end(ring, error, buffer->size)
+ * \endcode
+ *
+ * @retval -EBUSY - if readers are registered or another resize is in progress
+ */
+static
+int dmabuf_ring_resize_begin(struct dmabuf_ring* ring) {
+    int error = 0;
+
+    spin_lock(&ring->lock);
+    if(ring->nReaders != 0 || ring->resizing) error = -EBUSY;
+    else ring->resizing = true;
+    spin_unlock(&ring->lock);
+
+    return error;
+}
+
+/**
+ * Finish buffer resize, the ring size is changed only if the resize succeeded.
+ *
+ * @param error - result of the resize
+ * @param size - new buffer size
+ */
+static
+void dmabuf_ring_resize_end(struct dmabuf_ring* ring, int error, u64 size) {
+    spin_lock(&ring->lock);
+    if(error == 0) ring->size = size;
+    ring->resizing = false;
+    spin_unlock(&ring->lock);
+}
+
+/**
+ * Publish new producer position.
+ *
+ * \code
+ * if(head - reclaim > size) {
+ *     if(!DROP_OLDEST) return -ENOSPC
+ *     for_each(reader : lagging readers) reader->tail = head - size
+ * }
+ * ring->head = head
+ * \endcode
+ *
+ * @param ring - pointer to struct dmabuf_ring
+ * @param head - new producer position
+ *
+ * @return - 0 on success
+ *
+ * @retval -EINVAL - if head is behind current head
+ * @retval -ENOSPC - if head would overwrite data not consumed by slowest reader
+ */
+static
+int dmabuf_ring_publish(struct dmabuf_ring* ring, u64 head) {
+    int error = 0;
+    struct dmabuf_ring_reader* reader;
+
+    spin_lock(&ring->lock);
+
+    if(head < ring->head) {
+        error = -EINVAL;
+        goto out_unlock;
+    }
+
+    if(head - dmabuf_ring_reclaim_locked(ring) > ring->size) {
+        if(!(ring->flags & DMABUF_RING_DROP_OLDEST)) {
+            error = -ENOSPC;
+            goto out_unlock;
+        }
+        list_for_each_entry(reader, &ring->readers, list_head) {
+            if(head - reader->tail <= ring->size) continue;
+            reader->dropped += head - ring->size - reader->tail;
+            reader->tail = head - ring->size;
+        }
+    }
+
+    ring->head = head;
+
+out_unlock:
+    spin_unlock(&ring->lock);
+
+    if(error == 0) wake_up_interruptible_all(&ring->wait);
+
+    return error;
+}
+
+/**
+ * Advance reader position (release consumed data).
+ *
+ * Positions behind the reader are ignored if DMABUF_RING_DROP_OLDEST is set.
+ *
+ * @retval -EINVAL - if not registered or tail is outside of [reader->tail, head]
+ */
+static
+int dmabuf_ring_reader_advance(struct dmabuf_ring* ring, struct dmabuf_ring_reader* reader, u64 tail) {
+    int error = 0;
+
+    spin_lock(&ring->lock);
+    if(list_empty(&reader->list_head)) {
+        error = -EINVAL;
+    }
+    else if(tail > ring->head) {
+        error = -EINVAL;
+    }
+    else if(tail < reader->tail) {
+        // reader may have been pushed forward by DROP_OLDEST
+        if(!(ring->flags & DMABUF_RING_DROP_OLDEST)) error = -EINVAL;
+    }
+    else {
+        reader->tail = tail;
+    }
+    spin_unlock(&ring->lock);
+
+    if(error == 0) wake_up_interruptible_all(&ring->wait);
+
+    return error;
+}
+
+static
+void dmabuf_ring_status(struct dmabuf_ring* ring, struct dmabuf_ring_reader* reader, struct dmabuf_ring_status* status) {
+    spin_lock(&ring->lock);
+    status->size = ring->size;
+    status->head = ring->head;
+    status->reclaim = dmabuf_ring_reclaim_locked(ring);
+    if(!list_empty(&reader->list_head)) {
+        status->tail = reader->tail;
+        status->dropped = reader->dropped;
+    }
+    else {
+        status->tail = status->reclaim;
+        status->dropped = 0;
+    }
+    status->readers = ring->nReaders;
+    status->flags = ring->flags;
+    spin_unlock(&ring->lock);
+}
+
+/**
+ * Readers are readable when behind `head`,
+ * producer is writable when there is space up to the slowest reader.
+ */
+static
+__poll_t dmabuf_ring_poll(struct dmabuf_ring* ring, struct dmabuf_ring_reader* reader) {
+    __poll_t mask = 0;
+
+    spin_lock(&ring->lock);
+    if(!list_empty(&reader->list_head) && reader->tail != ring->head) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if(ring->head - dmabuf_ring_reclaim_locked(ring) < ring->size) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    spin_unlock(&ring->lock);
+
+    return mask;
+}
+
+/**
+ * Handle DMABUF_IOCTL_RING_* and DMABUF_IOCTL_READER_* commands.
+ *
+ * @retval -ENOTTY - if cmd is not a ring command
+ */
+static
+long dmabuf_ring_ioctl(struct dmabuf_ring* ring, struct dmabuf_ring_reader* reader, unsigned int cmd, unsigned long arg) {
+    void __user* user_arg = (void __user*)arg;
+    u64 position;
+    u32 flags;
+
+    switch(cmd) {
+    case DMABUF_IOCTL_RING_STATUS: {
+        struct dmabuf_ring_status status;
+        dmabuf_ring_status(ring, reader, &status);
+        if(copy_to_user(user_arg, &status, sizeof(status)) != 0) return -EFAULT;
+        return 0;
+    }
+    case DMABUF_IOCTL_RING_SET_FLAGS:
+        if(get_user(flags, (u32 __user*)user_arg) != 0) return -EFAULT;
+        if(flags & ~DMABUF_RING_DROP_OLDEST) return -EINVAL;
+        spin_lock(&ring->lock);
+        ring->flags = flags;
+        spin_unlock(&ring->lock);
+        return 0;
+    case DMABUF_IOCTL_RING_PUBLISH:
+        if(get_user(position, (u64 __user*)user_arg) != 0) return -EFAULT;
+        return dmabuf_ring_publish(ring, position);
+    case DMABUF_IOCTL_READER_REGISTER:
+        return dmabuf_ring_reader_add(ring, reader);
+    case DMABUF_IOCTL_READER_UNREGISTER:
+        dmabuf_ring_reader_del(ring, reader);
+        return 0;
+    case DMABUF_IOCTL_READER_ADVANCE:
+        if(get_user(position, (u64 __user*)user_arg) != 0) return -EFAULT;
+        return dmabuf_ring_reader_advance(ring, reader, position);
+    }
+
+    return -ENOTTY;
+}
@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#pragma once
+
+#include "dmabuf.h"
+#include "dmabuf_bank.h"
+
+/**
+ * Allocate all not committed slots that overlap range (sparse mode).
+ *
+ * @retval -EOPNOTSUPP - if not sparse
+ * @retval -EINVAL - if out of range
+ * @retval -ENOMEM - if slot could not be allocated (slots committed before are kept)
+ * @retval -EINTR - if interrupted by fatal signal
+ */
+static
+int dmabuf_sparse_commit_range(struct dmabuf* dmabuf, u64 offset, u64 size) {
+    int error = 0;
+    struct dmabuf_table* table;
+    int idx;
+
+    idx = srcu_read_lock(&dmabuf->srcu);
+    table = srcu_dereference(dmabuf->table, &dmabuf->srcu);
+
+    if(!table->sparse) error = -EOPNOTSUPP;
+    else if(offset > table->size || size > table->size - offset) error = -EINVAL;
+    else if(size > 0) {
+        for(unsigned int i = dmabuf_table_find(table, offset); i < table->count && table->entries[i].offset < offset + size; i++) {
+            if(dmabuf_table_entry(table, i, true) == NULL) {
+                error = -ENOMEM;
+                break;
+            }
+            error = dmabuf_yield();
+            if(error) break;
+        }
+    }
+
+    srcu_read_unlock(&dmabuf->srcu, idx);
+    return error;
+}
+
+/**
+ * Release slots that are fully inside range (sparse mode).
+ *
+ * \code
+ * lock(dmabuf->lock), down_write(commit_lock)
+ * released = table->entries[i].entry, table->entries[i].entry = NULL
+ * up_write(commit_lock)
+ * synchronize_srcu, unmap_mapping_range(mapping, range), free(released)
+ * \endcode
+ *
+ * @param dmabuf - pointer to struct dmabuf
+ * @param offset - offset in buffer
+ * @param size - size of range
+ * @param mapping - address space of user mappings (device inode, see dmabuf_fs_inode_new)
+ * @param mapping_offset - offset of the buffer in the mapping (bank offset)
+ *
+ * @retval -EOPNOTSUPP - if not sparse
+ * @retval -EINVAL - if out of range
+ */
+static
+int dmabuf_sparse_decommit(struct dmabuf* dmabuf, u64 offset, u64 size, struct address_space* mapping, u64 mapping_offset) {
+    int error = 0;
+    struct dmabuf_table* table;
+    size_t slot = dmabuf_entry_size_max();
+    u64 begin, end;
+    LIST_HEAD(released);
+
+    mutex_lock(&dmabuf->lock);
+    table = rcu_dereference_protected(dmabuf->table, true);
+
+    if(!table->sparse) {
+        error = -EOPNOTSUPP;
+        goto out_unlock;
+    }
+    if(offset > table->size || size > table->size - offset) {
+        error = -EINVAL;
+        goto out_unlock;
+    }
+
+    // whole slots (the last slot may end above buffer size)
+    begin = round_up(offset, slot);
+    end = offset + size == table->size ? round_up(table->size, slot) : round_down(offset + size, slot);
+    if(begin >= end) goto out_unlock;
+
+    down_write(&dmabuf->commit_lock);
+    for(unsigned int i = begin / slot; i < end / slot; i++) {
+        struct dmabuf_entry* entry = table->entries[i].entry;
+        if(entry == NULL) continue;
+        WRITE_ONCE(table->entries[i].entry, NULL);
+        list_add_tail(&entry->list_head, &released);
+    }
+    up_write(&dmabuf->commit_lock);
+    if(list_empty(&released)) goto out_unlock;
+
+    // wait for read/write/fault handlers that use released slots
+    synchronize_srcu(&dmabuf->srcu);
+    if(mapping != NULL) unmap_mapping_range(mapping, mapping_offset + begin, end - begin, 1);
+    dmabuf_entries_free(dmabuf, &released);
+    // content is zero again
+    dmabuf_dirty_set(table, begin, end - begin);
+
+out_unlock:
+    mutex_unlock(&dmabuf->lock);
+    return error;
+}
+
+/**
+ * Handle DMABUF_IOCTL_COMMIT and DMABUF_IOCTL_DECOMMIT.
+ *
+ * @retval -ENOTTY - if cmd is not a sparse mode command
+ */
+static
+long dmabuf_sparse_ioctl(struct dmabuf_banks* banks, struct address_space* mapping, unsigned int cmd, unsigned long arg) {
+    void __user* user_arg = (void __user*)arg;
+    struct dmabuf_range range;
+    struct dmabuf* dmabuf;
+    u64 offset;
+
+    if(cmd != DMABUF_IOCTL_COMMIT && cmd != DMABUF_IOCTL_DECOMMIT) return -ENOTTY;
+
+    if(copy_from_user(&range, user_arg, sizeof(range)) != 0) return -EFAULT;
+    offset = range.offset;
+    dmabuf = dmabuf_banks_get(banks, &range.offset);
+    if(dmabuf == NULL) return -EINVAL;
+
+    switch(cmd) {
+    case DMABUF_IOCTL_COMMIT:
+        return dmabuf_sparse_commit_range(dmabuf, range.offset, range.size);
+    case DMABUF_IOCTL_DECOMMIT:
+        return dmabuf_sparse_decommit(dmabuf, range.offset, range.size, mapping, offset - range.offset);
+    }
+
+    return -ENOTTY;
+}
@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 #pragma once
 
+#include "dmabuf_ioctl.h"
+
 #include <cerrno>
 #include <cstdio>
 #include <cstdint>
@@ -8,6 +10,7 @@
 #include <cstring>
 
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
@@ -88,4 +91,32 @@ struct test_t {
             exit(EXIT_FAILURE);
         }
     }
+
+    // returns -errno on failure
+    int ioctl(unsigned long request, void* arg = nullptr) const {
+        int error = ::ioctl(fd, request, arg);
+        if(error < 0) return -errno;
+        return error;
+    }
+
+    // info of bank at `offset` (DMABUF_BANK_OFFSET)
+    dmabuf_info info(uint64_t offset = 0) const {
+        dmabuf_info info {};
+        info.offset = offset;
+        if(ioctl(DMABUF_IOCTL_INFO, &info) != 0) {
+            FATAL("ioctl(DMABUF_IOCTL_INFO)\n");
+            exit(EXIT_FAILURE);
+        }
+        INFO("size = 0x%llx, entries = %llu, segments = %llu\n", info.size, info.entries, info.segments);
+        return info;
+    }
+
+    dmabuf_ring_status ring_status() const {
+        dmabuf_ring_status status {};
+        if(ioctl(DMABUF_IOCTL_RING_STATUS, &status) != 0) {
+            FATAL("ioctl(DMABUF_IOCTL_RING_STATUS)\n");
+            exit(EXIT_FAILURE);
+        }
+        return status;
+    }
 };
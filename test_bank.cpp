@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+// ping-pong mode (`insmod dmabuf.ko banks=2`)
+
+#include "test.h"
+
+#include <vector>
+
+int main() {
+    int exit_status = EXIT_SUCCESS;
+
+    test_t test;
+    dmabuf_bank_info info {};
+    if(test.ioctl(DMABUF_IOCTL_BANK_INFO, &info) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_BANK_INFO)\n");
+        exit(EXIT_FAILURE);
+    }
+    INFO("count = %u, active = %u, size = 0x%llx\n", info.count, info.active, info.size);
+
+    // each bank has its own memory at its own offset
+    std::vector<uint32_t*> banks(info.count);
+    for(uint32_t i = 0; i < info.count; i++) {
+        uint32_t value = 0xBA00 + i;
+        if(pwrite(test.fd, &value, sizeof(value), DMABUF_BANK_OFFSET(i)) != sizeof(value)) {
+            ERR("pwrite(bank = %u): errno = %d\n", i, errno);
+            exit_status = EXIT_FAILURE;
+        }
+        test.mmap(info.size, DMABUF_BANK_OFFSET(i));
+        banks[i] = test.addr;
+    }
+    for(uint32_t i = 0; i < info.count; i++) {
+        if(banks[i][0] == 0xBA00 + i) continue;
+        ERR("bank[%u][0] = 0x%x\n", i, banks[i][0]);
+        exit_status = EXIT_FAILURE;
+    }
+
+    // info and segments of each bank
+    for(uint32_t i = 0; i < info.count; i++) {
+        dmabuf_info bank_info {};
+        bank_info.offset = DMABUF_BANK_OFFSET(i);
+        if(test.ioctl(DMABUF_IOCTL_INFO, &bank_info) != 0 || bank_info.size != info.size) {
+            ERR("ioctl(DMABUF_IOCTL_INFO, bank = %u): size = 0x%llx\n", i, bank_info.size);
+            exit_status = EXIT_FAILURE;
+        }
+        std::vector<dmabuf_segment> segments(bank_info.segments);
+        dmabuf_segments s { segments.size(), (uintptr_t)segments.data(), DMABUF_BANK_OFFSET(i) };
+        if(test.ioctl(DMABUF_IOCTL_SEGMENTS, &s) != 0 || s.count != bank_info.segments) {
+            ERR("ioctl(DMABUF_IOCTL_SEGMENTS, bank = %u): count = %llu\n", i, s.count);
+            exit_status = EXIT_FAILURE;
+        }
+        INFO("bank = %u, segments = %llu, dma_addr = 0x%llx\n", i, s.count, s.count > 0 ? segments[0].dma_addr : 0ull);
+    }
+    // seek inside each bank (SEEK_END - end of the bank of the current position)
+    for(uint32_t i = 0; i < info.count; i++) {
+        off_t pos = lseek(test.fd, DMABUF_BANK_OFFSET(i), SEEK_SET);
+        off_t end = lseek(test.fd, 0, SEEK_END);
+        if(pos != off_t(DMABUF_BANK_OFFSET(i)) || end != off_t(DMABUF_BANK_OFFSET(i) + info.size)) {
+            ERR("lseek(bank = %u): pos = 0x%jx, end = 0x%jx\n", i, intmax_t(pos), intmax_t(end));
+            exit_status = EXIT_FAILURE;
+        }
+    }
+    if(lseek(test.fd, DMABUF_BANK_OFFSET(info.count), SEEK_SET) >= 0 || errno != EINVAL) {
+        ERR("lseek to missing bank != -EINVAL\n");
+        exit_status = EXIT_FAILURE;
+    }
+    test.seek_set(0);
+
+    dmabuf_info no_bank {};
+    no_bank.offset = DMABUF_BANK_OFFSET(info.count);
+    if(test.ioctl(DMABUF_IOCTL_INFO, &no_bank) != -EINVAL) {
+        ERR("ioctl(DMABUF_IOCTL_INFO) of missing bank != -EINVAL\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    // producer fills active bank, swap hands it over
+    uint32_t active = info.active;
+    for(uint64_t k = 1; k <= 2 * info.count; k++) {
+        uint64_t fill = k * 4096;
+        if(test.ioctl(DMABUF_IOCTL_BANK_COMMIT, &fill) != 0) {
+            ERR("ioctl(DMABUF_IOCTL_BANK_COMMIT)\n");
+            exit_status = EXIT_FAILURE;
+        }
+        dmabuf_bank_swap swap {};
+        test.ioctl(DMABUF_IOCTL_BANK_SWAP, &swap);
+        INFO("bank = %u, fill = 0x%llx, active = %u\n", swap.bank, swap.fill, swap.active);
+        if(swap.bank != active || swap.fill != fill || swap.active != (active + 1) % info.count) {
+            ERR("unexpected swap\n");
+            exit_status = EXIT_FAILURE;
+        }
+        active = swap.active;
+    }
+
+    uint64_t fill = info.size + 1;
+    if(test.ioctl(DMABUF_IOCTL_BANK_COMMIT, &fill) != -ENOSPC) {
+        ERR("commit above bank size != -ENOSPC\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    for(auto addr : banks) munmap(addr, info.size);
+
+    return exit_status;
+}
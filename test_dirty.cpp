@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+// dirty tracking (`insmod dmabuf.ko dirty=4096`)
+
+#include "test.h"
+
+#include <vector>
+
+// get and clear dirty bits of the whole buffer (of bank at `offset`)
+static
+std::vector<uint64_t> dirty_get(const test_t& test, uint64_t size, uint64_t& granule, uint64_t offset = 0) {
+    std::vector<uint64_t> bitmap(size / 4096 / 64 + 1);
+    dmabuf_dirty dirty {};
+    dirty.offset = offset;
+    dirty.size = size;
+    dirty.bitmap = (uint64_t)bitmap.data();
+    if(test.ioctl(DMABUF_IOCTL_DIRTY_GET, &dirty) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_DIRTY_GET)\n");
+        exit(EXIT_FAILURE);
+    }
+    granule = dirty.granule;
+    bitmap.resize((size / granule + 63) / 64);
+    INFO("granule = 0x%llx, count = %llu\n", dirty.granule, dirty.count);
+    return bitmap;
+}
+
+int main() {
+    int exit_status = EXIT_SUCCESS;
+
+    test_t test;
+    size_t size = test.seek_end();
+
+    dmabuf_dirty dirty {};
+    dirty.size = size;
+    int error = test.ioctl(DMABUF_IOCTL_DIRTY_GET, &dirty);
+    if(error == -EOPNOTSUPP) {
+        INFO("dirty tracking is disabled\n");
+        return EXIT_SUCCESS;
+    }
+    uint64_t granule = dirty.granule;
+    if(error != 0 || granule < 4096 || size < 32 * granule) {
+        FATAL("ioctl(DMABUF_IOCTL_DIRTY_GET): error = %d, granule = 0x%lx\n", error, granule);
+        exit(EXIT_FAILURE);
+    }
+
+    test.mmap(size, 0);
+    // read fault maps pages read-only
+    volatile uint32_t x = test.addr[10 * granule / 4];
+    (void)x;
+    dirty_get(test, size, granule);
+
+    // write, store through mapping and fill
+    uint32_t value = 0x12345678;
+    if(pwrite(test.fd, &value, sizeof(value), 3 * granule) != sizeof(value)) {
+        ERR("pwrite: errno = %d\n", errno);
+        exit_status = EXIT_FAILURE;
+    }
+    test.addr[10 * granule / 4] = value;
+    dmabuf_fill fill { 20 * granule, 2 * granule, value, 0 };
+    if(test.ioctl(DMABUF_IOCTL_FILL, &fill) != 0) {
+        ERR("ioctl(DMABUF_IOCTL_FILL)\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    auto bitmap = dirty_get(test, size, granule);
+    uint64_t expected = (1ull << 3) | (1ull << 10) | (1ull << 20) | (1ull << 21);
+    if(bitmap[0] != expected) {
+        ERR("bitmap[0] = 0x%lx != 0x%lx\n", bitmap[0], expected);
+        exit_status = EXIT_FAILURE;
+    }
+
+    // cleared by previous call
+    bitmap = dirty_get(test, size, granule);
+    for(size_t i = 0; i < bitmap.size(); i++) {
+        if(bitmap[i] == 0) continue;
+        ERR("bitmap[%zu] = 0x%lx != 0\n", i, bitmap[i]);
+        exit_status = EXIT_FAILURE;
+    }
+
+    // mapping is write-protected again
+    test.addr[10 * granule / 4] = value + 1;
+    bitmap = dirty_get(test, size, granule);
+    if(bitmap[0] != (1ull << 10)) {
+        ERR("bitmap[0] = 0x%lx != 0x%llx\n", bitmap[0], 1ull << 10);
+        exit_status = EXIT_FAILURE;
+    }
+
+    munmap(test.addr, size);
+
+    // mapping of bank 1 is write-protected again (`banks=2`)
+    dmabuf_bank_info bank_info {};
+    if(test.ioctl(DMABUF_IOCTL_BANK_INFO, &bank_info) == 0 && bank_info.count > 1) {
+        uint64_t bank = DMABUF_BANK_OFFSET(1);
+        test.mmap(size, bank);
+        dirty_get(test, size, granule, bank);
+        test.addr[5 * granule / 4] = value;
+        bitmap = dirty_get(test, size, granule, bank);
+        test.addr[5 * granule / 4] = value + 1;
+        auto bitmap2 = dirty_get(test, size, granule, bank);
+        if(bitmap[0] != (1ull << 5) || bitmap2[0] != (1ull << 5)) {
+            ERR("bank 1: bitmap[0] = 0x%lx, 0x%lx != 0x%llx\n", bitmap[0], bitmap2[0], 1ull << 5);
+            exit_status = EXIT_FAILURE;
+        }
+        munmap(test.addr, size);
+    }
+
+    return exit_status;
+}
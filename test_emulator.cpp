@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+// consume records of the emulator (`insmod dmabuf.ko emulator=1`)
+
+#include "test.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <poll.h>
+
+// copy from ring position (wrapping at the end of the buffer)
+static
+void ring_copy(const test_t& test, uint64_t size, uint64_t position, void* dst, size_t n) {
+    auto addr = (const char*)test.addr;
+    size_t offset = position % size;
+    size_t n1 = std::min<size_t>(n, size - offset);
+    memcpy(dst, addr + offset, n1);
+    memcpy((char*)dst + n1, addr, n - n1);
+}
+
+int main(int argc, char* argv[]) {
+    int exit_status = EXIT_SUCCESS;
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+
+    test_t test;
+    if(test.ioctl(DMABUF_IOCTL_READER_REGISTER) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_READER_REGISTER)\n");
+        exit(EXIT_FAILURE);
+    }
+    auto status = test.ring_status();
+    uint64_t size = status.size;
+    test.mmap(size, 0);
+
+    uint64_t tail = status.tail, records = 0, bytes = 0, gaps = 0, sequence = 0;
+    bool first = true;
+
+    auto t0 = std::chrono::steady_clock::now();
+    while(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() < seconds) {
+        pollfd pfd { test.fd, POLLIN, 0 };
+        if(poll(&pfd, 1, 100) <= 0) continue;
+
+        status = test.ring_status();
+        if(status.tail != tail) {
+            // pushed forward by DMABUF_RING_DROP_OLDEST (resync on next record)
+            tail = status.tail;
+            first = true;
+            continue;
+        }
+
+        while(status.head - tail >= sizeof(dmabuf_record)) {
+            dmabuf_record record;
+            ring_copy(test, size, tail, &record, sizeof(record));
+            if(first && record.magic != DMABUF_RECORD_MAGIC) {
+                // not at record boundary after drop, skip published data
+                tail = status.head;
+                break;
+            }
+            if(record.magic != DMABUF_RECORD_MAGIC || record.size < sizeof(record)) {
+                ERR("bad record at 0x%lx: magic = 0x%08x, size = %u\n", tail, record.magic, record.size);
+                exit_status = EXIT_FAILURE;
+                tail = status.head;
+                break;
+            }
+            if(status.head - tail < record.size) break;
+            if(!first && record.sequence != sequence + 1) gaps += record.sequence - sequence - 1;
+            first = false;
+            sequence = record.sequence;
+            records += 1;
+            bytes += record.size;
+            tail += record.size;
+        }
+
+        if(test.ioctl(DMABUF_IOCTL_READER_ADVANCE, &tail) != 0) {
+            // reader was pushed forward concurrently
+            tail = test.ring_status().tail;
+            first = true;
+        }
+    }
+    double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    status = test.ring_status();
+    INFO("records = %lu, rate = %.1f MB/s\n", records, bytes / dt / 1e6);
+    INFO("gaps = %lu records, dropped = 0x%llx bytes\n", gaps, status.dropped);
+    if(records == 0) {
+        ERR("no records (emulator=1 module parameter?)\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    return exit_status;
+}
@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include "test.h"
+
+#include <memory>
+#include <vector>
+
+#include <linux/udmabuf.h>
+#include <sys/mman.h>
+
+int main() {
+    int exit_status = EXIT_SUCCESS;
+
+    test_t test;
+    size_t old_size = test.seek_end();
+
+    // 64 MiB of hugepages (fall back to THP)
+    size_t size = 64 * 1024 * 1024, align = 2 * 1024 * 1024;
+    void* addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(addr == MAP_FAILED) {
+        INFO("MAP_HUGETLB: errno = %d, use THP\n", errno);
+        addr = ::mmap(nullptr, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(addr == MAP_FAILED) {
+            FATAL("mmap: errno = %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        addr = (void*)(((uintptr_t)addr + align - 1) & ~(align - 1));
+        madvise(addr, size, MADV_HUGEPAGE);
+    }
+
+    auto words = (uint32_t*)addr;
+    for(size_t i = 0; i < size / 4; i++) words[i] = i;
+
+    dmabuf_import import { (uintptr_t)addr, size };
+    if(test.ioctl(DMABUF_IOCTL_IMPORT, &import) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_IMPORT)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    auto i1 = test.info();
+    INFO("size = 0x%llx, entries = %llu, segments = %llu, flags = 0x%llx\n", i1.size, i1.entries, i1.segments, i1.flags);
+    if(i1.size != size || !(i1.flags & DMABUF_INFO_IMPORTED)) {
+        ERR("unexpected info after import\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    std::vector<dmabuf_segment> segments(i1.segments);
+    dmabuf_segments s { segments.size(), (uintptr_t)segments.data(), 0 };
+    test.ioctl(DMABUF_IOCTL_SEGMENTS, &s);
+    for(auto& segment : segments) {
+        INFO("offset = 0x%llx, dma_addr = 0x%llx, size = 0x%llx\n", segment.offset, segment.dma_addr, segment.size);
+    }
+
+    // read sees user memory
+    auto rbuffer = std::make_unique<uint32_t[]>(size / 4);
+    test.seek_set(0);
+    test.read(rbuffer.get(), size);
+    for(size_t i = 0; i < size / 4; i++) {
+        if(rbuffer[i] == i) continue;
+        ERR("rbuffer[0x%zx] != 0x%zx\n", i, i);
+        exit_status = EXIT_FAILURE;
+        break;
+    }
+
+    // write is visible in user memory (no copy)
+    uint32_t value = 0xCAFEBABE;
+    test.seek_set(size - 4);
+    test.write(&value, 4);
+    if(words[size / 4 - 1] != value) {
+        ERR("write through device is not visible in user memory\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    // dma-buf from memfd through udmabuf
+    int udmabuf = ::open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if(udmabuf < 0) {
+        INFO("/dev/udmabuf: errno = %d, skip dma-buf import\n", errno);
+    }
+    else {
+        size_t memfd_size = 16 * 1024 * 1024;
+        int memfd = memfd_create("test_import", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+        if(memfd < 0 || ftruncate(memfd, memfd_size) != 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+            FATAL("memfd: errno = %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        auto memfd_words = (uint32_t*)::mmap(nullptr, memfd_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        for(size_t i = 0; i < memfd_size / 4; i++) memfd_words[i] = ~i;
+
+        udmabuf_create create { (uint32_t)memfd, UDMABUF_FLAGS_CLOEXEC, 0, memfd_size };
+        int32_t fd = ::ioctl(udmabuf, UDMABUF_CREATE, &create);
+        if(fd < 0) {
+            FATAL("ioctl(UDMABUF_CREATE): errno = %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if(test.ioctl(DMABUF_IOCTL_IMPORT_DMA_BUF, &fd) != 0) {
+            ERR("ioctl(DMABUF_IOCTL_IMPORT_DMA_BUF)\n");
+            exit_status = EXIT_FAILURE;
+        }
+        auto i2 = test.info();
+        INFO("size = 0x%llx, entries = %llu, segments = %llu\n", i2.size, i2.entries, i2.segments);
+
+        if(i2.size != memfd_size || i2.segments == 0) {
+            ERR("size = 0x%llx, segments = %llu\n", i2.size, i2.segments);
+            exit_status = EXIT_FAILURE;
+        }
+
+        // the memory of the exporter is not accessed by the CPU through the buffer
+        if(::pread(test.fd, rbuffer.get(), 4096, 0) >= 0 || errno != EOPNOTSUPP) {
+            ERR("pread: errno = %d != EOPNOTSUPP\n", errno);
+            exit_status = EXIT_FAILURE;
+        }
+        if(::mmap(nullptr, memfd_size, PROT_READ | PROT_WRITE, MAP_SHARED, test.fd, 0) != MAP_FAILED || errno != EOPNOTSUPP) {
+            ERR("mmap: errno = %d != EOPNOTSUPP\n", errno);
+            exit_status = EXIT_FAILURE;
+        }
+        dmabuf_checksum checksum { 0, memfd_size, DMABUF_CHECKSUM_CRC32C, 0, 0, 0 };
+        if(test.ioctl(DMABUF_IOCTL_CHECKSUM, &checksum) != -EOPNOTSUPP) {
+            ERR("ioctl(DMABUF_IOCTL_CHECKSUM) != -EOPNOTSUPP\n");
+            exit_status = EXIT_FAILURE;
+        }
+
+        close(fd);
+        close(memfd);
+        close(udmabuf);
+    }
+
+    // release imported memory
+    uint64_t resize = old_size;
+    if(test.ioctl(DMABUF_IOCTL_RESIZE, &resize) != 0) {
+        ERR("ioctl(DMABUF_IOCTL_RESIZE)\n");
+        exit_status = EXIT_FAILURE;
+    }
+    if(test.info().flags & DMABUF_INFO_IMPORTED) {
+        ERR("buffer is still imported after resize\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    return exit_status;
+}
@@ -42,6 +42,63 @@ int main() {
         exit_status = EXIT_FAILURE;
     }
 
+    // partial progress: the second page of the user buffer faults
+    if(size >= 2 * 4096) {
+        auto pages = (char*)::mmap(nullptr, 2 * 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(pages == MAP_FAILED || mprotect(pages + 4096, 4096, PROT_NONE) != 0) {
+            FATAL("mmap: errno = %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        memset(pages, 0xA5, 4096);
+        ssize_t n = pwrite(test.fd, pages, 2 * 4096, 0);
+        INFO("pwrite: n = 0x%zx\n", n);
+        if(n <= 0 || n > 4096) {
+            ERR("pwrite: n = 0x%zx, errno = %d\n", n, errno);
+            exit_status = EXIT_FAILURE;
+        }
+        for(ssize_t i = 0; i < n; i++) {
+            if(((volatile char*)test.addr)[i] == char(0xA5)) continue;
+            ERR("mmap_addr[0x%zx] != 0xA5\n", i);
+            exit_status = EXIT_FAILURE;
+            break;
+        }
+        n = pread(test.fd, pages, 2 * 4096, 0);
+        INFO("pread: n = 0x%zx\n", n);
+        if(n <= 0 || n > 4096) {
+            ERR("pread: n = 0x%zx, errno = %d\n", n, errno);
+            exit_status = EXIT_FAILURE;
+        }
+        munmap(pages, 2 * 4096);
+    }
+
+    // read-only file: shared mapping is allowed, private (copy-on-write) is not
+    {
+        int fd = ::open("/dev/dmabuf0", O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            FATAL("open: errno = %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, offset);
+        if(addr == MAP_FAILED) {
+            ERR("mmap(O_RDONLY, MAP_SHARED): errno = %d\n", errno);
+            exit_status = EXIT_FAILURE;
+        }
+        else {
+            if(memcmp(addr, test.addr, 4096) != 0) {
+                ERR("mmap(O_RDONLY) != mmap(O_RDWR)\n");
+                exit_status = EXIT_FAILURE;
+            }
+            munmap(addr, size);
+        }
+        addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, offset);
+        if(addr != MAP_FAILED || errno != EINVAL) {
+            ERR("mmap(MAP_PRIVATE): errno = %d\n", errno);
+            exit_status = EXIT_FAILURE;
+            if(addr != MAP_FAILED) munmap(addr, size);
+        }
+        close(fd);
+    }
+
     // cleanup
     munmap(test.addr, size);
 
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include "test.h"
+
+#include <initializer_list>
+#include <memory>
+
+// bitwise CRC32C (Castagnoli) for reference
+static
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t size) {
+    crc = ~crc;
+    for(size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for(int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static
+uint64_t checksum(const test_t& test, uint64_t offset, uint64_t size, uint32_t algorithm) {
+    dmabuf_checksum checksum {};
+    checksum.offset = offset;
+    checksum.size = size;
+    checksum.algorithm = algorithm;
+    if(test.ioctl(DMABUF_IOCTL_CHECKSUM, &checksum) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_CHECKSUM)\n");
+        exit(EXIT_FAILURE);
+    }
+    return checksum.value;
+}
+
+int main() {
+    int exit_status = EXIT_SUCCESS;
+
+    test_t test;
+    size_t size = test.seek_end();
+    size_t half = size / 2;
+
+    // fill first half with counter
+    dmabuf_fill fill {};
+    fill.offset = 0;
+    fill.size = half;
+    fill.value = 0;
+    fill.step = 1;
+    if(test.ioctl(DMABUF_IOCTL_FILL, &fill) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_FILL)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // check first MiB with read and reference CRC32C
+    size_t n = 1024 * 1024;
+    auto rbuffer = std::make_unique<uint32_t[]>(n/4);
+    test.seek_set(0);
+    test.read(rbuffer.get(), n);
+    for(size_t i = 0; i < n/4; i++) {
+        if(rbuffer[i] == i) continue;
+        ERR("rbuffer[0x%zx] != 0x%zx\n", i, i);
+        exit_status = EXIT_FAILURE;
+        break;
+    }
+    uint32_t crc = crc32c(0, reinterpret_cast<const uint8_t*>(rbuffer.get()), n);
+    if(checksum(test, 0, n, DMABUF_CHECKSUM_CRC32C) != crc) {
+        ERR("DMABUF_CHECKSUM_CRC32C != 0x%08x\n", crc);
+        exit_status = EXIT_FAILURE;
+    }
+
+    // copy first half to second half (not page aligned)
+    dmabuf_copy copy {};
+    copy.dst = half + 4;
+    copy.src = 0;
+    copy.size = half - 4;
+    if(test.ioctl(DMABUF_IOCTL_COPY, &copy) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_COPY)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // overlapping copy back by 4 bytes
+    copy.dst = half;
+    copy.src = half + 4;
+    if(test.ioctl(DMABUF_IOCTL_COPY, &copy) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_COPY)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(uint32_t algorithm : { DMABUF_CHECKSUM_CRC32C, DMABUF_CHECKSUM_XXH64 }) {
+        uint64_t a = checksum(test, 0, half - 4, algorithm);
+        uint64_t b = checksum(test, half, half - 4, algorithm);
+        INFO("algorithm = %u, checksum = 0x%lx\n", algorithm, a);
+        if(a == b) continue;
+        ERR("checksum of copy 0x%lx != 0x%lx\n", b, a);
+        exit_status = EXIT_FAILURE;
+    }
+
+    return exit_status;
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include "test.h"
+#include "dmabuf_pmr.h"
+
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+int main() {
+    int exit_status = EXIT_SUCCESS;
+
+    test_t test;
+    dmabuf_map_t map;
+    INFO("size = 0x%zx, segments = %zu\n", map.size, map.segments.size());
+
+    // build container in place in DMA memory
+    dmabuf_arena_resource_t arena(map);
+    std::pmr::vector<uint32_t> v(&arena);
+    for(uint32_t i = 0; i < 1024 * 1024; i++) v.push_back(i);
+    INFO("arena used = 0x%zx\n", arena.used());
+
+    // data is visible through the device (no copy)
+    size_t offset = reinterpret_cast<char*>(v.data()) - static_cast<char*>(map.addr);
+    std::vector<uint32_t> rbuffer(v.size());
+    test.seek_set(offset);
+    test.read(rbuffer.data(), rbuffer.size() * 4);
+    if(rbuffer != std::vector<uint32_t>(v.begin(), v.end())) {
+        ERR("read != pmr::vector\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    uint64_t dma_addr = map.dma_addr(v.data());
+    INFO("v.data() = %p, dma_addr = 0x%lx, dma_size = 0x%zx\n", (void*)v.data(), dma_addr, map.dma_size(v.data()));
+    if(map.dma_size(v.data()) == 0 || map.dma_addr(static_cast<char*>(map.addr) + map.size) != 0) {
+        ERR("dma_addr translation\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    // pool reuses freed blocks
+    dmabuf_pool_resource_t pool(arena);
+    void* p1 = pool.allocate(100, 8);
+    pool.deallocate(p1, 100, 8);
+    void* p2 = pool.allocate(128, 8);
+    if(p1 != p2 || !map.contains(p2)) {
+        ERR("pool block is not reused\n");
+        exit_status = EXIT_FAILURE;
+    }
+    pool.deallocate(p2, 128, 8);
+
+    std::pmr::vector<std::pmr::string> strings(&pool);
+    for(int i = 0; i < 1000; i++) strings.emplace_back(std::string(100, 'a' + i % 26));
+    if(!map.contains(strings.back().data())) {
+        ERR("pmr::string is not in DMA memory\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    // map of the last bank (`banks=2`)
+    dmabuf_bank_info bank_info {};
+    if(test.ioctl(DMABUF_IOCTL_BANK_INFO, &bank_info) == 0 && bank_info.count > 1) {
+        dmabuf_map_t bank_map("/dev/dmabuf0", 0, DMABUF_BANK_OFFSET(bank_info.count - 1));
+        INFO("bank = %u, size = 0x%zx, segments = %zu\n", bank_info.count - 1, bank_map.size, bank_map.segments.size());
+        if(bank_map.size != bank_info.size || bank_map.segments.empty() || bank_map.dma_size(bank_map.addr) == 0) {
+            ERR("bank map: size = 0x%zx\n", bank_map.size);
+            exit_status = EXIT_FAILURE;
+        }
+    }
+
+    return exit_status;
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include "test.h"
+
+struct queue_t {
+    dmabuf_queue_setup setup {};
+    char* addr = nullptr;
+
+    dmabuf_queue_header* header() const { return (dmabuf_queue_header*)addr; }
+    dmabuf_queue_sqe* sq() const { return (dmabuf_queue_sqe*)(addr + setup.sq_offset); }
+    dmabuf_queue_cqe* cq() const { return (dmabuf_queue_cqe*)(addr + setup.cq_offset); }
+
+    // next free submission entry
+    dmabuf_queue_sqe* sqe() const {
+        auto h = header();
+        if(h->sq_tail - __atomic_load_n(&h->sq_head, __ATOMIC_ACQUIRE) >= setup.entries) return nullptr;
+        auto sqe = &sq()[h->sq_tail & (setup.entries - 1)];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+    void submit() const {
+        __atomic_store_n(&header()->sq_tail, header()->sq_tail + 1, __ATOMIC_RELEASE);
+    }
+    // next completion (or nullptr)
+    dmabuf_queue_cqe* cqe() const {
+        auto h = header();
+        if(h->cq_head == __atomic_load_n(&h->cq_tail, __ATOMIC_ACQUIRE)) return nullptr;
+        return &cq()[h->cq_head & (setup.entries - 1)];
+    }
+    void consume() const {
+        __atomic_store_n(&header()->cq_head, header()->cq_head + 1, __ATOMIC_RELEASE);
+    }
+};
+
+int main() {
+    int exit_status = EXIT_SUCCESS;
+
+    test_t test;
+    size_t half = test.seek_end() / 2;
+
+    queue_t queue;
+    queue.setup.entries = 64;
+    if(test.ioctl(DMABUF_IOCTL_QUEUE_SETUP, &queue.setup) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_QUEUE_SETUP)\n");
+        exit(EXIT_FAILURE);
+    }
+    queue.addr = (char*)::mmap(nullptr, queue.setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, test.fd, DMABUF_QUEUE_OFFSET);
+    if(queue.addr == MAP_FAILED) {
+        FATAL("mmap(DMABUF_QUEUE_OFFSET): errno = %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    INFO("entries = %u, size = 0x%llx\n", queue.setup.entries, queue.setup.size);
+
+    // fill, copy and checksum both halves in one batch
+    auto sqe = queue.sqe();
+    sqe->opcode = DMABUF_OP_FILL;
+    sqe->user_data = 1;
+    sqe->fill = { 0, half, 0x12345678, 1 };
+    queue.submit();
+
+    sqe = queue.sqe();
+    sqe->opcode = DMABUF_OP_COPY;
+    sqe->user_data = 2;
+    sqe->copy = { half, 0, half };
+    queue.submit();
+
+    for(uint64_t i = 0; i < 2; i++) {
+        sqe = queue.sqe();
+        sqe->opcode = DMABUF_OP_CHECKSUM;
+        sqe->user_data = 3 + i;
+        sqe->checksum.offset = i * half;
+        sqe->checksum.size = half;
+        sqe->checksum.algorithm = DMABUF_CHECKSUM_XXH64;
+        queue.submit();
+    }
+
+    sqe = queue.sqe();
+    sqe->opcode = 0xFFFF; // invalid
+    sqe->user_data = 5;
+    queue.submit();
+
+    int n = test.ioctl(DMABUF_IOCTL_QUEUE_ENTER);
+    if(n != 5) {
+        ERR("DMABUF_IOCTL_QUEUE_ENTER = %d\n", n);
+        exit_status = EXIT_FAILURE;
+    }
+
+    __u64 checksum[2] = {};
+    for(auto cqe = queue.cqe(); cqe != nullptr; cqe = queue.cqe()) {
+        INFO("user_data = %llu, result = %lld, value = 0x%llx\n", cqe->user_data, cqe->result, cqe->value);
+        int64_t expected = cqe->user_data == 5 ? -EINVAL : 0;
+        if(cqe->result != expected) {
+            ERR("result = %lld\n", cqe->result);
+            exit_status = EXIT_FAILURE;
+        }
+        if(cqe->user_data == 3 || cqe->user_data == 4) checksum[cqe->user_data - 3] = cqe->value;
+        queue.consume();
+    }
+    if(checksum[0] == 0 || checksum[0] != checksum[1]) {
+        ERR("checksum of copy 0x%llx != 0x%llx\n", checksum[1], checksum[0]);
+        exit_status = EXIT_FAILURE;
+    }
+
+    munmap(queue.addr, queue.setup.size);
+
+    return exit_status;
+}
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include "test.h"
+
+#include <csetjmp>
+#include <csignal>
+#include <memory>
+
+static sigjmp_buf sigbus_env;
+
+static
+void sigbus_handler(int) {
+    siglongjmp(sigbus_env, 1);
+}
+
+// true if read of `p` raises SIGBUS
+static
+bool sigbus(const volatile uint32_t* p) {
+    struct sigaction action {}, old_action {};
+    action.sa_handler = sigbus_handler;
+    sigaction(SIGBUS, &action, &old_action);
+    bool raised = true;
+    if(sigsetjmp(sigbus_env, 1) == 0) {
+        (void)*p;
+        raised = false;
+    }
+    sigaction(SIGBUS, &old_action, nullptr);
+    return raised;
+}
+
+int main() {
+    int exit_status = EXIT_SUCCESS;
+
+    test_t test;
+    dmabuf_bank_info bank_info {};
+    if(test.ioctl(DMABUF_IOCTL_BANK_INFO, &bank_info) == 0 && bank_info.count > 1) {
+        INFO("resize is not allowed with banks\n");
+        return EXIT_SUCCESS;
+    }
+
+    auto initial = test.info();
+    uint64_t size = initial.size, half = (size / 2) & ~uint64_t(4096 - 1);
+    if(half == 0) {
+        INFO("buffer is too small\n");
+        return EXIT_SUCCESS;
+    }
+
+    // fill and map the whole buffer
+    auto wbuffer = std::make_unique<uint32_t[]>(size / 4);
+    for(uint64_t i = 0; i < size / 4; i++) wbuffer[i] = i;
+    test.seek_set(0);
+    test.write(wbuffer.get(), size);
+    test.mmap(size, 0);
+    auto addr = static_cast<volatile uint32_t*>(test.addr);
+
+    // shrink - retained data stays mapped, released range raises SIGBUS
+    if(test.ioctl(DMABUF_IOCTL_RESIZE, &half) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_RESIZE, size = 0x%lx)\n", half);
+        exit(EXIT_FAILURE);
+    }
+    auto shrunk = test.info();
+    if(shrunk.size != half || shrunk.generation != initial.generation + 1) {
+        ERR("shrink: size = 0x%llx, generation = %llu\n", shrunk.size, shrunk.generation);
+        exit_status = EXIT_FAILURE;
+    }
+    if(shrunk.entries == 0 || shrunk.entries > initial.entries || shrunk.segments > shrunk.entries || shrunk.fragmentation > 1000) {
+        ERR("shrink: entries = %llu, segments = %llu, fragmentation = %llu\n", shrunk.entries, shrunk.segments, shrunk.fragmentation);
+        exit_status = EXIT_FAILURE;
+    }
+    for(uint64_t i = 0; i < half / 4; i++) {
+        if(addr[i] == wbuffer[i]) continue;
+        ERR("shrink: mmap_addr[0x%lx] = 0x%x\n", i, addr[i]);
+        exit_status = EXIT_FAILURE;
+        break;
+    }
+    if(!sigbus(addr + half / 4) || !sigbus(addr + size / 4 - 1)) {
+        ERR("shrink: released range does not raise SIGBUS\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    // grow - new range reads as zeros
+    if(test.ioctl(DMABUF_IOCTL_RESIZE, &size) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_RESIZE, size = 0x%lx)\n", size);
+        exit(EXIT_FAILURE);
+    }
+    auto grown = test.info();
+    if(grown.size != size || grown.generation != initial.generation + 2) {
+        ERR("grow: size = 0x%llx, generation = %llu\n", grown.size, grown.generation);
+        exit_status = EXIT_FAILURE;
+    }
+    if(grown.entries < shrunk.entries || grown.segments > grown.entries || grown.fragmentation > 1000) {
+        ERR("grow: entries = %llu, segments = %llu, fragmentation = %llu\n", grown.entries, grown.segments, grown.fragmentation);
+        exit_status = EXIT_FAILURE;
+    }
+    for(uint64_t i = 0; i < half / 4; i++) {
+        if(addr[i] == wbuffer[i]) continue;
+        ERR("grow: mmap_addr[0x%lx] = 0x%x\n", i, addr[i]);
+        exit_status = EXIT_FAILURE;
+        break;
+    }
+    for(uint64_t i = half / 4; i < size / 4; i++) {
+        if(addr[i] == 0) continue;
+        ERR("grow: mmap_addr[0x%lx] = 0x%x\n", i, addr[i]);
+        exit_status = EXIT_FAILURE;
+        break;
+    }
+    auto rbuffer = std::make_unique<uint32_t[]>((size - half) / 4);
+    test.seek_set(half);
+    test.read(rbuffer.get(), size - half);
+    for(uint64_t i = 0; i < (size - half) / 4; i++) {
+        if(rbuffer[i] == 0) continue;
+        ERR("grow: rbuffer[0x%lx] = 0x%x\n", i, rbuffer[i]);
+        exit_status = EXIT_FAILURE;
+        break;
+    }
+
+    // cleanup
+    munmap(test.addr, size);
+
+    return exit_status;
+}
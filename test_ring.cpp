@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include "test.h"
+
+int main() {
+    int exit_status = EXIT_SUCCESS;
+
+    // producer and two readers
+    test_t producer, reader1, reader2;
+    uint64_t size = producer.ring_status().size;
+    uint64_t head = producer.ring_status().head;
+
+    uint32_t flags = 0;
+    producer.ioctl(DMABUF_IOCTL_RING_SET_FLAGS, &flags);
+
+    if(reader1.ioctl(DMABUF_IOCTL_READER_REGISTER) != 0 || reader2.ioctl(DMABUF_IOCTL_READER_REGISTER) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_READER_REGISTER)\n");
+        exit(EXIT_FAILURE);
+    }
+    if(reader1.ioctl(DMABUF_IOCTL_READER_REGISTER) != -EBUSY) {
+        ERR("second DMABUF_IOCTL_READER_REGISTER != -EBUSY\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    // fill the whole ring
+    head += size;
+    if(producer.ioctl(DMABUF_IOCTL_RING_PUBLISH, &head) != 0) {
+        ERR("publish(head = 0x%lx) failed\n", head);
+        exit_status = EXIT_FAILURE;
+    }
+
+    // no space until the slowest reader advances
+    uint64_t next = head + 4096;
+    if(producer.ioctl(DMABUF_IOCTL_RING_PUBLISH, &next) != -ENOSPC) {
+        ERR("publish past slowest reader != -ENOSPC\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    // reader1 consumes everything, reader2 still holds the ring
+    reader1.ioctl(DMABUF_IOCTL_READER_ADVANCE, &head);
+    if(producer.ioctl(DMABUF_IOCTL_RING_PUBLISH, &next) != -ENOSPC) {
+        ERR("reclaim is not the slowest reader\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    // drop oldest for lagging reader2
+    flags = DMABUF_RING_DROP_OLDEST;
+    producer.ioctl(DMABUF_IOCTL_RING_SET_FLAGS, &flags);
+    if(producer.ioctl(DMABUF_IOCTL_RING_PUBLISH, &next) != 0) {
+        ERR("publish with DMABUF_RING_DROP_OLDEST failed\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    auto status1 = reader1.ring_status(), status2 = reader2.ring_status();
+    INFO("reader1: tail = 0x%llx, dropped = 0x%llx\n", status1.tail, status1.dropped);
+    INFO("reader2: tail = 0x%llx, dropped = 0x%llx\n", status2.tail, status2.dropped);
+    if(status1.dropped != 0 || status2.dropped != 4096 || status2.tail != next - size) {
+        ERR("unexpected reader state\n");
+        exit_status = EXIT_FAILURE;
+    }
+    if(status1.readers != 2 || status1.reclaim != next - size) {
+        ERR("readers = %u, reclaim = 0x%llx\n", status1.readers, status1.reclaim);
+        exit_status = EXIT_FAILURE;
+    }
+
+    return exit_status;
+}
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+// sparse mode (`insmod dmabuf.ko sparse=1`)
+
+#include "test.h"
+
+int main() {
+    int exit_status = EXIT_SUCCESS;
+
+    test_t test;
+    auto initial = test.info();
+    if(!(initial.flags & DMABUF_INFO_SPARSE)) {
+        INFO("sparse mode is disabled\n");
+        return EXIT_SUCCESS;
+    }
+
+    // decommit zaps the mapping of bank 1 (`banks=2`, resize is not allowed)
+    dmabuf_bank_info bank_info {};
+    if(test.ioctl(DMABUF_IOCTL_BANK_INFO, &bank_info) == 0 && bank_info.count > 1) {
+        uint64_t bank = DMABUF_BANK_OFFSET(1);
+        test.mmap(1 << 20, bank);
+        test.addr[0] = 0x12345678;
+        dmabuf_range range { bank, bank_info.size };
+        if(test.ioctl(DMABUF_IOCTL_DECOMMIT, &range) != 0) {
+            ERR("ioctl(DMABUF_IOCTL_DECOMMIT, bank = 1)\n");
+            exit_status = EXIT_FAILURE;
+        }
+        // the released slot is not reachable through the old pte
+        if(((volatile uint32_t*)test.addr)[0] != 0) {
+            ERR("bank 1 after decommit: value = 0x%x\n", test.addr[0]);
+            exit_status = EXIT_FAILURE;
+        }
+        munmap(test.addr, 1 << 20);
+        return exit_status;
+    }
+
+    // reserve 16 GiB (no memory is allocated)
+    uint64_t size = 16ull << 30;
+    if(test.ioctl(DMABUF_IOCTL_RESIZE, &size) != 0) {
+        FATAL("ioctl(DMABUF_IOCTL_RESIZE)\n");
+        exit(EXIT_FAILURE);
+    }
+    auto entries = test.info().entries;
+
+    // read does not allocate
+    uint32_t value = 0xFFFFFFFF;
+    if(pread(test.fd, &value, sizeof(value), 8ull << 30) != sizeof(value) || value != 0) {
+        ERR("pread: value = 0x%x\n", value);
+        exit_status = EXIT_FAILURE;
+    }
+    if(test.info().entries != entries) {
+        ERR("pread committed memory\n");
+        exit_status = EXIT_FAILURE;
+    }
+
+    // write, store through mapping and commit allocate slots
+    value = 0x12345678;
+    if(pwrite(test.fd, &value, sizeof(value), 8ull << 30) != sizeof(value)) {
+        ERR("pwrite: errno = %d\n", errno);
+        exit_status = EXIT_FAILURE;
+    }
+    test.mmap(1 << 20, 12ull << 30);
+    test.addr[0] = value;
+    munmap(test.addr, 1 << 20);
+    dmabuf_range range { 4ull << 30, 4ull << 20 };
+    if(test.ioctl(DMABUF_IOCTL_COMMIT, &range) != 0) {
+        ERR("ioctl(DMABUF_IOCTL_COMMIT)\n");
+        exit_status = EXIT_FAILURE;
+    }
+    auto committed = test.info();
+    if(committed.entries < entries + 3 || committed.segments == 0) {
+        ERR("entries = %llu, segments = %llu\n", committed.entries, committed.segments);
+        exit_status = EXIT_FAILURE;
+    }
+
+    // release everything
+    range = { 0, size };
+    if(test.ioctl(DMABUF_IOCTL_DECOMMIT, &range) != 0) {
+        ERR("ioctl(DMABUF_IOCTL_DECOMMIT)\n");
+        exit_status = EXIT_FAILURE;
+    }
+    if(test.info().entries != 0) {
+        ERR("entries != 0 after decommit\n");
+        exit_status = EXIT_FAILURE;
+    }
+    if(pread(test.fd, &value, sizeof(value), 8ull << 30) != sizeof(value) || value != 0) {
+        ERR("pread after decommit: value = 0x%x\n", value);
+        exit_status = EXIT_FAILURE;
+    }
+
+    size = initial.size;
+    test.ioctl(DMABUF_IOCTL_RESIZE, &size);
+
+    return exit_status;
+}